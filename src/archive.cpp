@@ -0,0 +1,1294 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+
+#include "bytes.h"
+#include "bufferpool.h"
+#include "codec.h"
+#include "threadpool.h"
+
+#include "archive.h"
+
+#define NAME_LENGTH_MAX   0xFFFF
+#define FRAME_LENGTH_MAX  (64 * 1024 * 1024)
+#define INDEX_LENGTH_MAX  (256 * 1024 * 1024)
+#define INDEX_ENTRY_MIN   10        // type, name length, size, extra length, offset and CRC, all empty
+#define INDEX_RESERVE_MAX 65536     // entries made room for up front; the rest as they parse
+#define STREAM_CHUNK      (64 * 1024)
+
+static void putField(vector<unsigned char>& extra, unsigned char tag, const unsigned char* data, size_t len)
+{
+    extra.push_back(tag);
+    szip::Bytes::writeVarint(len, extra, extra.size());
+    extra.insert(extra.end(), data, data + len);
+}
+
+static void encodeExtra(const SzipEntry& entry, vector<unsigned char>& extra)
+{
+    unsigned char field[32];
+    size_t len;
+
+    if (entry.mode != 0)
+    {
+        len = szip::Bytes::writeVarint(entry.mode, field, 0);
+        putField(extra, EXTRA_MODE, field, len);
+
+        // Zigzag, so times before 1970 stay short.
+        uint64_t seconds = ((uint64_t)entry.mtime << 1) ^ (uint64_t)(entry.mtime >> 63);
+        len = szip::Bytes::writeVarint(seconds, field, 0);
+        len += szip::Bytes::writeVarint(entry.mtimeNsec, field, len);
+        putField(extra, EXTRA_MTIME, field, len);
+    }
+
+    if (!entry.target.empty())
+    {
+        putField(extra, EXTRA_TARGET, (const unsigned char*)entry.target.data(), entry.target.length());
+    }
+
+    if (entry.sparseLength != 0)
+    {
+        vector<unsigned char> map(2 * 10 * (entry.extents.size() + 1));
+        len = szip::Bytes::writeVarint(entry.sparseLength, map.data(), 0);
+        len += szip::Bytes::writeVarint(entry.extents.size(), map.data(), len);
+
+        // Each extent as the gap since the previous one ended, which keeps the varints short.
+        uint64_t end = 0;
+        for (size_t i = 0; i < entry.extents.size(); i++)
+        {
+            len += szip::Bytes::writeVarint(entry.extents[i].offset - end, map.data(), len);
+            len += szip::Bytes::writeVarint(entry.extents[i].length, map.data(), len);
+            end = entry.extents[i].offset + entry.extents[i].length;
+        }
+
+        putField(extra, EXTRA_SPARSE, map.data(), len);
+    }
+}
+
+// The extents must be in order, lie inside the file and add up to the stored data.
+static bool decodeSparse(const unsigned char* p, size_t pos, size_t end, SzipEntry& entry)
+{
+    uint64_t count = 0, gap = 0, total = 0, position = 0;
+    size_t k;
+
+    if ((k = szip::Bytes::peekVarint(p, pos, end, entry.sparseLength)) == 0)
+    {
+        return false;
+    }
+
+    pos += k;
+    if ((k = szip::Bytes::peekVarint(p, pos, end, count)) == 0 || count > SPARSE_EXTENTS_MAX)
+    {
+        return false;
+    }
+
+    pos += k;
+    entry.extents.resize((size_t)count);
+    for (size_t i = 0; i < entry.extents.size(); i++)
+    {
+        SzipExtent& extent = entry.extents[i];
+        if ((k = szip::Bytes::peekVarint(p, pos, end, gap)) == 0)
+        {
+            return false;
+        }
+
+        pos += k;
+        if ((k = szip::Bytes::peekVarint(p, pos, end, extent.length)) == 0)
+        {
+            return false;
+        }
+
+        pos += k;
+        if (gap > entry.sparseLength - position || extent.length > entry.sparseLength - position - gap)
+        {
+            return false;
+        }
+
+        extent.offset = position + gap;
+        position = extent.offset + extent.length;
+        total += extent.length;
+    }
+
+    return total == entry.size;
+}
+
+// Unknown tags are skipped so older readers can still extract newer archives.
+static bool decodeExtra(const unsigned char* p, size_t n, SzipEntry& entry)
+{
+    size_t pos = 0;
+
+    while (pos < n)
+    {
+        unsigned char tag = p[pos++];
+        uint64_t len = 0, value = 0;
+        size_t k = szip::Bytes::peekVarint(p, pos, n, len);
+        if (k == 0 || len > n - pos - k)
+        {
+            return false;
+        }
+
+        pos += k;
+        size_t end = pos + (size_t)len;
+
+        switch (tag)
+        {
+            case EXTRA_MODE:
+                if (szip::Bytes::peekVarint(p, pos, end, value) == 0)
+                {
+                    return false;
+                }
+                entry.mode = (uint32_t)value;
+                break;
+            case EXTRA_MTIME:
+                if ((k = szip::Bytes::peekVarint(p, pos, end, value)) == 0)
+                {
+                    return false;
+                }
+                entry.mtime = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+                if (szip::Bytes::peekVarint(p, pos + k, end, value) == 0)
+                {
+                    return false;
+                }
+                entry.mtimeNsec = (uint32_t)value;
+                break;
+            case EXTRA_TARGET:
+                entry.target.assign((const char*)p + pos, (size_t)len);
+                break;
+            case EXTRA_SPARSE:
+                if (!decodeSparse(p, pos, end, entry))
+                {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+
+        pos = end;
+    }
+
+    return true;
+}
+
+// Parses one record header from p[0, n). Returns 1 with need set to the header length when
+// complete, 0 with need set to the minimum header length when more bytes are required, and
+// -1 when the bytes can't be a header.
+static int parseRecordHeader(const unsigned char* p, size_t n, bool legacy, SzipEntry& entry, size_t& need)
+{
+    if (n < 3)
+    {
+        need = 3;
+        return 0;
+    }
+
+    size_t nameLength = szip::Bytes::peek<unsigned short>((unsigned char*)p, 1);
+    size_t pos = 3 + nameLength;
+    if (n < pos)
+    {
+        need = pos;
+        return 0;
+    }
+
+    entry.type = p[0];
+    entry.name.assign((const char*)p + 3, nameLength);
+    entry.size = 0;
+    entry.crc  = 0;
+    entry.mode = 0;
+    entry.mtime = 0;
+    entry.mtimeNsec = 0;
+    entry.target.clear();
+    entry.sparseLength = 0;
+    entry.extents.clear();
+
+    if (legacy)
+    {
+        if (entry.type != PUT_DIR_T && entry.type != PUT_FILE_T)
+        {
+            return -1;
+        }
+
+        if (entry.type == PUT_FILE_T)
+        {
+            if (n < pos + 4)
+            {
+                need = pos + 4;
+                return 0;
+            }
+
+            entry.size = szip::Bytes::peek<unsigned int>((unsigned char*)p, pos);
+            pos += 4;
+        }
+
+        need = pos;
+        return 1;
+    }
+
+    if (entry.type == 0)
+    {
+        return -1;
+    }
+
+    uint64_t extraLength = 0;
+    for (int field = 0; field < 2; field++)
+    {
+        uint64_t value = 0;
+        size_t length = szip::Bytes::peekVarint(p, pos, n, value);
+        if (length == 0)
+        {
+            if (n - pos >= 10)
+            {
+                return -1;
+            }
+
+            need = n + 1;
+            return 0;
+        }
+
+        pos += length;
+        if (field == 0)
+        {
+            entry.size = value;
+        }
+        else
+        {
+            extraLength = value;
+        }
+    }
+
+    if (extraLength > NAME_LENGTH_MAX)
+    {
+        return -1;
+    }
+
+    if (n < pos + extraLength)
+    {
+        need = pos + (size_t)extraLength;
+        return 0;
+    }
+
+    if (!decodeExtra(p + pos, (size_t)extraLength, entry))
+    {
+        return -1;
+    }
+
+    need = pos + (size_t)extraLength;
+    return 1;
+}
+
+RecordParser::RecordParser(bool legacy) : legacy(legacy), remaining(0), position(0), inData(false)
+{
+
+}
+
+int RecordParser::feed(const unsigned char* data, size_t len, RecordHandler& handler)
+{
+    size_t i = 0;
+
+    while (i < len)
+    {
+        if (inData)
+        {
+            size_t n = (size_t)min<uint64_t>(remaining, len - i);
+            if (!handler.data(data + i, n))
+            {
+                return Z_STREAM_END;
+            }
+
+            i += n;
+            position += n;
+            remaining -= n;
+
+            if (remaining == 0)
+            {
+                inData = false;
+                if (!handler.end())
+                {
+                    return Z_STREAM_END;
+                }
+            }
+
+            continue;
+        }
+
+        size_t need = 0;
+        int parsed;
+
+        if (header.empty())
+        {
+            // Common case: the whole header sits in this chunk and is parsed in place.
+            parsed = parseRecordHeader(data + i, len - i, legacy, entry, need);
+            if (parsed == 1)
+            {
+                i += need;
+                position += need;
+            }
+        }
+        else
+        {
+            parsed = 0;
+            need = header.size() + 1;
+        }
+
+        while (parsed == 0)
+        {
+            if (header.size() < need)
+            {
+                size_t n = min(need - header.size(), len - i);
+                header.insert(header.end(), data + i, data + i + n);
+                i += n;
+                position += n;
+
+                if (header.size() < need)
+                {
+                    return Z_OK;
+                }
+            }
+
+            parsed = parseRecordHeader(header.data(), header.size(), legacy, entry, need);
+        }
+
+        if (parsed < 0)
+        {
+            return Z_DATA_ERROR;
+        }
+
+        // A completed header can't have consumed more than it needed.
+        assert(header.empty() || header.size() == need);
+        header.clear();
+
+        if (legacy)
+        {
+            if (entry.type == PUT_DIR_T)
+            {
+                legacyDir = entry.name;
+            }
+            else if (!legacyDir.empty())
+            {
+                entry.name = legacyDir + "/" + entry.name;
+            }
+        }
+
+        entry.offset = position;
+        if (!handler.begin(entry))
+        {
+            return Z_STREAM_END;
+        }
+
+        if (entry.size == 0)
+        {
+            if (!handler.end())
+            {
+                return Z_STREAM_END;
+            }
+        }
+        else
+        {
+            inData = true;
+            remaining = entry.size;
+        }
+    }
+
+    return Z_OK;
+}
+
+bool RecordParser::atBoundary() const
+{
+    return !inData && header.empty();
+}
+
+// One frame being compressed for the writer or decoded for a walk. Whoever needs the result
+// first runs it: a pool worker if one got to it, otherwise the waiting thread itself, so
+// waiting never depends on a free worker. The task owns its buffers, which lets a worker
+// finish safely after the writer or walk that posted it has given up.
+struct FrameTask
+{
+    bool           encode;
+    int            codec, level;        // encode only
+    unsigned char  method;              // decode only
+    unsigned char* raw;
+    size_t         rawLength, rawCapacity;
+    unsigned char* packed;
+    size_t         packedLength, packedCapacity;
+    uint64_t       rawOffset;
+    FrameSource*   source;              // decode only: where to fetch packed from, at sourceOffset
+    uint64_t       sourceOffset;
+    int            result;
+    bool           done;
+    atomic<bool>   claimed;
+    mutex              lock;
+    condition_variable finished;
+
+    FrameTask() : encode(false), codec(SZIP_CODEC_ZLIB), level(Z_DEFAULT_COMPRESSION), method(METHOD_STORE), raw(NULL), rawLength(0), rawCapacity(0),
+        packed(NULL), packedLength(0), packedCapacity(0), rawOffset(0), source(NULL), sourceOffset(0), result(Z_OK), done(false), claimed(false) {}
+
+    ~FrameTask()
+    {
+        if (raw != NULL)     BufferPool::shared().release(raw, rawCapacity);
+        if (packed != NULL)  BufferPool::shared().release(packed, packedCapacity);
+    }
+
+    void run()
+    {
+        if (claimed.exchange(true))
+        {
+            return;
+        }
+
+        int r;
+        if (encode)
+        {
+            packedLength = packedCapacity;
+            r = Codec::compress(codec, level, raw, rawLength, packed, packedLength);
+        }
+        else
+        {
+            r = (source != NULL) ? source->read(sourceOffset, packed, packedLength) : Z_OK;
+
+            // Stored frames are used straight from the packed buffer.
+            if (r == Z_OK)
+            {
+                r = (method == METHOD_STORE) ? ((packedLength == rawLength) ? Z_OK : Z_DATA_ERROR)
+                                             : decodeFramePayload(method, packed, (uint32_t)packedLength, raw, (uint32_t)rawLength);
+            }
+        }
+
+        lock_guard<mutex> guard(lock);
+        result = r;
+        done = true;
+        finished.notify_all();
+    }
+
+    int wait()
+    {
+        run();
+
+        unique_lock<mutex> guard(lock);
+        while (!done)
+        {
+            finished.wait(guard);
+        }
+
+        return result;
+    }
+
+    const unsigned char* output() const
+    {
+        return (!encode && method == METHOD_STORE) ? packed : raw;
+    }
+
+    static void start(const shared_ptr<FrameTask>& task, size_t threads)
+    {
+        if (threads > 1)
+        {
+            ThreadPool::shared().post([task]() { task->run(); });
+        }
+    }
+};
+
+ArchiveWriter::ArchiveWriter(ostream& os, size_t blockSize, int level, int codec, size_t threads) :
+    os(os), blockSize(blockSize), level(level), codec(codec), block(NULL), used(0), rawPosition(0), remaining(0), status(Z_OK), threads(threads)
+{
+    assert(blockSize > 0 && blockSize <= FRAME_LENGTH_MAX);
+    block = BufferPool::shared().acquire(blockSize);
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    BufferPool::shared().release(block, blockSize);
+}
+
+int ArchiveWriter::start()
+{
+    unsigned char const magic[] = { SZIP_MAGIC, SZIP_MAGIC_INDEXED };
+    os.write((char*)magic, 2);
+    archive.indexOffset = 2;
+
+    return status = os.good() ? Z_OK : Z_ERRNO;
+}
+
+int ArchiveWriter::resume(const ArchiveIndex& index)
+{
+    archive = index;
+    rawPosition = index.blocks.empty() ? 0 : index.blocks.back().rawOffset + index.blocks.back().rawLength;
+
+    return status = os.good() ? Z_OK : Z_ERRNO;
+}
+
+int ArchiveWriter::begin(const SzipEntry& entry)
+{
+    if (status != Z_OK)
+    {
+        return status;
+    }
+
+    if (remaining > 0 || entry.name.length() > NAME_LENGTH_MAX)
+    {
+        return status = Z_STREAM_ERROR;
+    }
+
+    vector<unsigned char> header;
+    encodeRecordHeader(entry, header);
+
+    SzipEntry indexed = entry;
+    indexed.offset = rawPosition + header.size();
+    indexed.crc = 0;
+    archive.entries.push_back(indexed);
+    remaining = entry.size;
+
+    return append(header.data(), header.size());
+}
+
+int ArchiveWriter::data(const unsigned char* data, size_t len)
+{
+    while (len > 0 && status == Z_OK)
+    {
+        size_t n = len;
+        unsigned char* p = reserve(n);
+        memcpy(p, data, n);
+        commit(n);
+
+        data += n;
+        len -= n;
+    }
+
+    return status;
+}
+
+unsigned char* ArchiveWriter::reserve(size_t& len)
+{
+    len = min(len, blockSize - used);
+    return block + used;
+}
+
+int ArchiveWriter::commit(size_t len)
+{
+    if (status != Z_OK)
+    {
+        return status;
+    }
+
+    if (len > remaining || archive.entries.empty())
+    {
+        return status = Z_STREAM_ERROR;
+    }
+
+    SzipEntry& entry = archive.entries.back();
+    entry.crc = Codec::crc32(entry.crc, block + used, len);
+    remaining -= len;
+    used += len;
+    rawPosition += len;
+
+    if (used == blockSize)
+    {
+        return flushBlock();
+    }
+
+    return Z_OK;
+}
+
+int ArchiveWriter::endGroup()
+{
+    if (used >= blockSize / 4)
+    {
+        return flushBlock();
+    }
+
+    return status;
+}
+
+int ArchiveWriter::finish()
+{
+    if (status == Z_OK && remaining > 0)
+    {
+        status = Z_STREAM_ERROR;
+    }
+
+    if (status != Z_OK || flushBlock() != Z_OK || drain(0) != Z_OK)
+    {
+        return status;
+    }
+
+    vector<unsigned char> index;
+    encodeIndex(archive, index);
+    if (index.size() > INDEX_LENGTH_MAX)
+    {
+        return status = Z_BUF_ERROR;
+    }
+
+    // Stored when deflate doesn't help, so no frame ever packs larger than compressBound of its limit.
+    uint64_t indexOffset = archive.indexOffset;
+    if (writeFrame(FRAME_INDEX, index.data(), index.size(), true) != Z_OK)
+    {
+        return status;
+    }
+
+    unsigned char trailer[TRAILER_SIZE];
+    szip::Bytes::write<uint64_t>(indexOffset, trailer, 0);
+    trailer[8] = SZIP_MAGIC;
+    trailer[9] = SZIP_MAGIC_INDEXED;
+    os.write((char*)trailer, TRAILER_SIZE);
+    os.flush();
+
+    archive.indexOffset = indexOffset;
+
+    return status = os.good() ? Z_OK : Z_ERRNO;
+}
+
+const ArchiveIndex& ArchiveWriter::index() const
+{
+    return archive;
+}
+
+// private:
+
+int ArchiveWriter::append(const unsigned char* data, size_t len)
+{
+    while (len > 0 && status == Z_OK)
+    {
+        size_t n = min(len, blockSize - used);
+        memcpy(block + used, data, n);
+        used += n;
+        rawPosition += n;
+        data += n;
+        len -= n;
+
+        if (used == blockSize)
+        {
+            flushBlock();
+        }
+    }
+
+    return status;
+}
+
+int ArchiveWriter::flushBlock()
+{
+    if (used == 0 || status != Z_OK)
+    {
+        return status;
+    }
+
+    // The filled block moves into a task and a fresh one takes its place.
+    BufferPool& pool = BufferPool::shared();
+    shared_ptr<FrameTask> task = make_shared<FrameTask>();
+    task->encode = true;
+    task->codec = codec;
+    task->level = level;
+    task->raw = block;
+    task->rawLength = used;
+    task->rawCapacity = blockSize;
+    task->packedCapacity = Codec::bound(codec, used);
+    task->packed = pool.acquire(task->packedCapacity);
+    task->rawOffset = rawPosition - used;
+
+    block = pool.acquire(blockSize);
+    used = 0;
+
+    pending.push_back(task);
+    FrameTask::start(task, threads);
+
+    return drain((threads > 1) ? threads : 0);
+}
+
+// Writes finished blocks, oldest first, until at most keep are left in flight.
+int ArchiveWriter::drain(size_t keep)
+{
+    while (pending.size() > keep && status == Z_OK)
+    {
+        shared_ptr<FrameTask> task = pending.front();
+        pending.pop_front();
+
+        int result = task->wait();
+        if (result != Z_OK)
+        {
+            return status = result;
+        }
+
+        ArchiveBlock b;
+        b.offset = archive.indexOffset;
+        b.rawOffset = task->rawOffset;
+        b.rawLength = (uint32_t)task->rawLength;
+
+        if (emitFrame(FRAME_BLOCK, task->raw, task->rawLength, task->packed, task->packedLength, true) != Z_OK)
+        {
+            return status;
+        }
+
+        b.packedLength = (uint32_t)(archive.indexOffset - b.offset - FRAME_HEADER_SIZE);
+        archive.blocks.push_back(b);
+    }
+
+    return status;
+}
+
+int ArchiveWriter::writeFrame(unsigned char kind, const unsigned char* raw, size_t rawLength, bool allowStore)
+{
+    BufferPool& pool = BufferPool::shared();
+    size_t capacity = Codec::bound(codec, rawLength);
+    unsigned char* packed = pool.acquire(capacity);
+
+    size_t packedLength = capacity;
+    int result = Codec::compress(codec, level, raw, rawLength, packed, packedLength);
+    if (result == Z_OK)
+    {
+        emitFrame(kind, raw, rawLength, packed, packedLength, allowStore);
+    }
+    else
+    {
+        status = result;
+    }
+
+    pool.release(packed, capacity);
+
+    return status;
+}
+
+int ArchiveWriter::emitFrame(unsigned char kind, const unsigned char* raw, size_t rawLength, const unsigned char* packed, size_t packedLength, bool allowStore)
+{
+    // Incompressible blocks are stored as is, which also makes them free to read back.
+    unsigned char method = METHOD_DEFLATE;
+    const unsigned char* payload = packed;
+    if (allowStore && packedLength >= rawLength)
+    {
+        method = METHOD_STORE;
+        payload = raw;
+        packedLength = rawLength;
+    }
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    header[0] = kind;
+    header[1] = method;
+    szip::Bytes::write<uint32_t>((uint32_t)rawLength, header, 2);
+    szip::Bytes::write<uint32_t>((uint32_t)packedLength, header, 6);
+
+    os.write((char*)header, FRAME_HEADER_SIZE);
+    os.write((char*)payload, packedLength);
+
+    archive.indexOffset += FRAME_HEADER_SIZE + packedLength;
+
+    return status = os.good() ? Z_OK : Z_ERRNO;
+}
+
+void encodeRecordHeader(const SzipEntry& entry, vector<unsigned char>& buffer)
+{
+    size_t pos = buffer.size();
+    buffer.push_back((unsigned char)entry.type);
+    pos++;
+    pos += szip::Bytes::write<unsigned short>((unsigned short)entry.name.length(), buffer, pos);
+    buffer.insert(buffer.end(), entry.name.begin(), entry.name.end());
+    pos += entry.name.length();
+    pos += szip::Bytes::writeVarint(entry.size, buffer, pos);
+
+    vector<unsigned char> extra;
+    encodeExtra(entry, extra);
+    szip::Bytes::writeVarint(extra.size(), buffer, pos);
+    buffer.insert(buffer.end(), extra.begin(), extra.end());
+}
+
+void encodeIndex(const ArchiveIndex& index, vector<unsigned char>& buffer)
+{
+    size_t pos = buffer.size();
+    buffer.push_back(INDEX_VERSION);
+    pos++;
+    pos += szip::Bytes::writeVarint(index.blocks.size(), buffer, pos);
+
+    vector<uint32_t> lengths(index.blocks.size());
+    for (size_t i = 0; i < index.blocks.size(); i++)
+    {
+        lengths[i] = index.blocks[i].rawLength;
+    }
+    pos += szip::Bytes::writeArray(lengths.data(), lengths.size(), buffer, pos);
+
+    for (size_t i = 0; i < index.blocks.size(); i++)
+    {
+        lengths[i] = index.blocks[i].packedLength;
+    }
+    pos += szip::Bytes::writeArray(lengths.data(), lengths.size(), buffer, pos);
+
+    pos += szip::Bytes::writeVarint(index.entries.size(), buffer, pos);
+    for (size_t i = 0; i < index.entries.size(); i++)
+    {
+        const SzipEntry& entry = index.entries[i];
+        encodeRecordHeader(entry, buffer);
+        pos = buffer.size();
+        pos += szip::Bytes::writeVarint(entry.offset, buffer, pos);
+        pos += szip::Bytes::write<uint32_t>(entry.crc, buffer, pos);
+    }
+}
+
+bool decodeIndex(unsigned char* data, size_t len, uint64_t indexOffset, ArchiveIndex& index)
+{
+    if (len < 1 || data[0] > INDEX_VERSION)
+    {
+        return false;
+    }
+
+    size_t pos = 1, n;
+    uint64_t count = 0;
+    // Every block frame takes at least its header ahead of the index.
+    if ((n = szip::Bytes::peekVarint(data, pos, len, count)) == 0 || count > (len - pos - n) / 8 ||
+        indexOffset < 2 || count > (indexOffset - 2) / FRAME_HEADER_SIZE)
+    {
+        return false;
+    }
+    pos += n;
+
+    vector<uint32_t> rawLengths((size_t)count), packedLengths((size_t)count);
+    szip::Bytes::peekArray(data, pos, rawLengths.data(), rawLengths.size());
+    pos += rawLengths.size() * 4;
+    szip::Bytes::peekArray(data, pos, packedLengths.data(), packedLengths.size());
+    pos += packedLengths.size() * 4;
+
+    index.blocks.resize((size_t)count);
+    uint64_t offset = 2, rawOffset = 0;
+    for (size_t i = 0; i < index.blocks.size(); i++)
+    {
+        ArchiveBlock& b = index.blocks[i];
+        b.offset = offset;
+        b.rawOffset = rawOffset;
+        b.rawLength = rawLengths[i];
+        b.packedLength = packedLengths[i];
+
+        offset += FRAME_HEADER_SIZE + b.packedLength;
+        rawOffset += b.rawLength;
+    }
+
+    if (offset != indexOffset)
+    {
+        return false;
+    }
+    index.indexOffset = indexOffset;
+
+    if ((n = szip::Bytes::peekVarint(data, pos, len, count)) == 0 || count > (len - pos - n) / INDEX_ENTRY_MIN)
+    {
+        return false;
+    }
+    pos += n;
+
+    // The count comes from the archive, so memory is only committed as entries parse.
+    index.entries.clear();
+    index.entries.reserve((size_t)min<uint64_t>(count, INDEX_RESERVE_MAX));
+    for (uint64_t i = 0; i < count; i++)
+    {
+        SzipEntry entry;
+        size_t need = 0;
+        if (parseRecordHeader(data + pos, len - pos, false, entry, need) != 1)
+        {
+            return false;
+        }
+        pos += need;
+
+        if ((n = szip::Bytes::peekVarint(data, pos, len, entry.offset)) == 0 || len - pos - n < 4)
+        {
+            return false;
+        }
+        pos += n;
+
+        entry.crc = szip::Bytes::peek<uint32_t>(data, pos);
+        pos += 4;
+
+        uint64_t end = entry.offset + entry.size;
+        if (end < entry.offset || end > rawOffset)
+        {
+            return false;
+        }
+
+        index.entries.push_back(move(entry));
+    }
+
+    return true;
+}
+
+int readMagic(istream& is)
+{
+    unsigned char magic[2] = { 0, 0 };
+    is.read((char*)magic, 2);
+
+    if (is.gcount() != 2 || magic[0] != SZIP_MAGIC || (magic[1] != SZIP_MAGIC_LEGACY && magic[1] != SZIP_MAGIC_INDEXED))
+    {
+        return 0;
+    }
+
+    return magic[1];
+}
+
+int readIndex(istream& is, ArchiveIndex& index)
+{
+    is.clear();
+    is.seekg(0, ios::end);
+    uint64_t size = (uint64_t)is.tellg();
+    if (!is.good() || size < 2 + TRAILER_SIZE)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    unsigned char trailer[TRAILER_SIZE];
+    is.seekg(size - TRAILER_SIZE);
+    is.read((char*)trailer, TRAILER_SIZE);
+    if (is.gcount() != TRAILER_SIZE || trailer[8] != SZIP_MAGIC || trailer[9] != SZIP_MAGIC_INDEXED)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    uint64_t indexOffset = szip::Bytes::peek<uint64_t>(trailer, 0);
+    if (indexOffset < 2 || indexOffset + FRAME_HEADER_SIZE > size - TRAILER_SIZE)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    is.seekg(indexOffset);
+
+    unsigned char kind, method;
+    uint32_t rawLength, packedLength;
+    int result = readFrameHeader(is, kind, method, rawLength, packedLength);
+    if (result != Z_OK)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    if (kind != FRAME_INDEX || indexOffset + FRAME_HEADER_SIZE + packedLength != size - TRAILER_SIZE)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    // Even a well-formed index can hold more entries than there is memory for.
+    try
+    {
+        vector<unsigned char> raw(rawLength);
+        result = readFramePayload(is, method, rawLength, packedLength, raw.data());
+        if (result != Z_OK)
+        {
+            return result;
+        }
+
+        return decodeIndex(raw.data(), raw.size(), indexOffset, index) ? Z_OK : Z_DATA_ERROR;
+    }
+    catch (const bad_alloc&)
+    {
+        return Z_MEM_ERROR;
+    }
+}
+
+static int parseFrameHeader(unsigned char* header, unsigned char& kind, unsigned char& method, uint32_t& rawLength, uint32_t& packedLength)
+{
+    kind = header[0];
+    method = header[1];
+    rawLength = szip::Bytes::peek<uint32_t>(header, 2);
+    packedLength = szip::Bytes::peek<uint32_t>(header, 6);
+
+    if ((kind != FRAME_BLOCK && kind != FRAME_INDEX) || (method != METHOD_STORE && method != METHOD_DEFLATE))
+    {
+        return Z_DATA_ERROR;
+    }
+
+    // Lengths are checked before anything is allocated for them, so a damaged header
+    // can't ask for gigabytes.
+    uLong limit = (kind == FRAME_BLOCK) ? FRAME_LENGTH_MAX : INDEX_LENGTH_MAX;
+    if (rawLength > limit || packedLength > compressBound(limit))
+    {
+        return Z_DATA_ERROR;
+    }
+
+    return Z_OK;
+}
+
+int readFrameHeader(istream& is, unsigned char& kind, unsigned char& method, uint32_t& rawLength, uint32_t& packedLength)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    is.read((char*)header, FRAME_HEADER_SIZE);
+
+    if (is.gcount() == 0 && is.eof())
+    {
+        return Z_STREAM_END;
+    }
+
+    if (is.gcount() != FRAME_HEADER_SIZE)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    return parseFrameHeader(header, kind, method, rawLength, packedLength);
+}
+
+int readFramePayload(istream& is, unsigned char method, uint32_t rawLength, uint32_t packedLength, unsigned char* raw)
+{
+    if (method == METHOD_STORE)
+    {
+        if (packedLength != rawLength)
+        {
+            return Z_DATA_ERROR;
+        }
+
+        is.read((char*)raw, rawLength);
+        return ((uint32_t)is.gcount() == rawLength) ? Z_OK : Z_DATA_ERROR;
+    }
+
+    BufferPool& pool = BufferPool::shared();
+    unsigned char* packed = pool.acquire(packedLength);
+    is.read((char*)packed, packedLength);
+
+    int result = Z_DATA_ERROR;
+    if ((uint32_t)is.gcount() == packedLength)
+    {
+        result = decodeFramePayload(method, packed, packedLength, raw, rawLength);
+    }
+
+    pool.release(packed, packedLength);
+
+    return result;
+}
+
+int decodeFramePayload(unsigned char method, const unsigned char* packed, uint32_t packedLength, unsigned char* raw, uint32_t rawLength)
+{
+    if (method == METHOD_STORE)
+    {
+        if (packedLength != rawLength)
+        {
+            return Z_DATA_ERROR;
+        }
+
+        memcpy(raw, packed, rawLength);
+        return Z_OK;
+    }
+
+    size_t length = rawLength;
+    int result = Codec::uncompress(packed, packedLength, raw, length);
+
+    return (result == Z_OK && length == rawLength) ? Z_OK : Z_DATA_ERROR;
+}
+
+static int walkLegacy(istream& is, RecordHandler& handler)
+{
+    BufferPool& pool = BufferPool::shared();
+    unsigned char* in = pool.acquire(STREAM_CHUNK);
+    unsigned char* out = pool.acquire(STREAM_CHUNK);
+
+    RecordParser parser(true);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    bool finished = false;
+    int result = inflateInit(&stream);
+    while (result == Z_OK && !finished)
+    {
+        is.read((char*)in, STREAM_CHUNK);
+        stream.next_in = in;
+        stream.avail_in = (uInt)is.gcount();
+        if (stream.avail_in == 0)
+        {
+            result = Z_DATA_ERROR;
+            break;
+        }
+
+        do
+        {
+            stream.next_out = out;
+            stream.avail_out = STREAM_CHUNK;
+
+            int inflated = inflate(&stream, Z_NO_FLUSH);
+            if (inflated == Z_STREAM_END)
+            {
+                finished = true;
+            }
+            else if (inflated != Z_OK && inflated != Z_BUF_ERROR)
+            {
+                result = (inflated == Z_MEM_ERROR) ? inflated : Z_DATA_ERROR;
+                break;
+            }
+
+            result = parser.feed(out, STREAM_CHUNK - stream.avail_out, handler);
+        }
+        while (result == Z_OK && !finished && stream.avail_out == 0);
+    }
+
+    if (result == Z_OK && !parser.atBoundary())
+    {
+        result = Z_DATA_ERROR;
+    }
+
+    inflateEnd(&stream);
+    pool.release(in, STREAM_CHUNK);
+    pool.release(out, STREAM_CHUNK);
+
+    return result;
+}
+
+static int walkIndexed(istream& is, RecordHandler& handler, size_t threads, ArchiveIndex* index, FrameSource* source)
+{
+    BufferPool& pool = BufferPool::shared();
+    RecordParser parser(false);
+    deque<shared_ptr<FrameTask>> pending;
+
+    // Nor can a frame run past the end of the archive, when there is an end to know of.
+    uint64_t offset = 2, end = UINT64_MAX;
+    if (source != NULL)
+    {
+        end = source->size();
+    }
+    else
+    {
+        streampos here = is.tellg();
+        if (here >= 0)
+        {
+            is.seekg(0, ios::end);
+            end = (uint64_t)is.tellg();
+            is.seekg(here);
+        }
+    }
+
+    int result = Z_OK, readResult = Z_OK;
+    bool reading = true, indexFound = false;
+    unsigned char indexMethod = 0;
+    uint32_t indexRawLength = 0, indexPackedLength = 0;
+
+    while (true)
+    {
+        // Keep up to threads frames read and decoding ahead of the parser. A read error only
+        // counts once the frames before it have been handed over, as a sequential walk would.
+        while (reading && pending.size() < max<size_t>(threads, 1))
+        {
+            unsigned char kind, method;
+            uint32_t rawLength, packedLength;
+
+            int headerResult;
+            if (source != NULL)
+            {
+                unsigned char header[FRAME_HEADER_SIZE];
+                headerResult = source->read(offset, header, FRAME_HEADER_SIZE);
+                if (headerResult == Z_OK)
+                {
+                    headerResult = parseFrameHeader(header, kind, method, rawLength, packedLength);
+                }
+            }
+            else
+            {
+                headerResult = readFrameHeader(is, kind, method, rawLength, packedLength);
+            }
+
+            if (headerResult == Z_OK && offset + FRAME_HEADER_SIZE + packedLength > end)
+            {
+                headerResult = Z_DATA_ERROR;
+            }
+
+            if (headerResult != Z_OK)
+            {
+                // Running out of frames before the index means the archive was cut short.
+                readResult = Z_DATA_ERROR;
+                reading = false;
+                break;
+            }
+
+            if (kind == FRAME_INDEX)
+            {
+                indexFound = true;
+                indexMethod = method;
+                indexRawLength = rawLength;
+                indexPackedLength = packedLength;
+                reading = false;
+                break;
+            }
+
+            shared_ptr<FrameTask> task = make_shared<FrameTask>();
+            task->method = method;
+            task->rawLength = rawLength;
+            task->packedLength = packedLength;
+            task->packedCapacity = packedLength;
+            task->packed = pool.acquire(packedLength);
+            if (method != METHOD_STORE)
+            {
+                task->rawCapacity = rawLength;
+                task->raw = pool.acquire(rawLength);
+            }
+
+            if (source != NULL)
+            {
+                task->source = source;
+                task->sourceOffset = offset + FRAME_HEADER_SIZE;
+            }
+            else
+            {
+                is.read((char*)task->packed, packedLength);
+                if ((uint32_t)is.gcount() != packedLength)
+                {
+                    readResult = Z_DATA_ERROR;
+                    reading = false;
+                    break;
+                }
+            }
+
+            offset += FRAME_HEADER_SIZE + packedLength;
+            pending.push_back(task);
+            FrameTask::start(task, threads);
+        }
+
+        if (pending.empty())
+        {
+            result = readResult;
+            break;
+        }
+
+        shared_ptr<FrameTask> task = pending.front();
+        pending.pop_front();
+
+        result = task->wait();
+        if (result != Z_OK)
+        {
+            break;
+        }
+
+        result = parser.feed(task->output(), task->rawLength, handler);
+        if (result != Z_OK)
+        {
+            break;
+        }
+    }
+
+    if (result == Z_OK && indexFound)
+    {
+        result = parser.atBoundary() ? Z_OK : Z_DATA_ERROR;
+    }
+
+    if (result == Z_OK && index != NULL)
+    {
+        // As in readIndex(), running out of memory is an error code, not an exception.
+        try
+        {
+            vector<unsigned char> raw(indexRawLength);
+            if (source != NULL)
+            {
+                vector<unsigned char> packed(indexPackedLength);
+                result = source->read(offset + FRAME_HEADER_SIZE, packed.data(), packed.size());
+                if (result == Z_OK)
+                {
+                    result = decodeFramePayload(indexMethod, packed.data(), indexPackedLength, raw.data(), indexRawLength);
+                }
+
+                is.clear();
+                is.seekg(offset + FRAME_HEADER_SIZE + indexPackedLength);
+            }
+            else
+            {
+                result = readFramePayload(is, indexMethod, indexRawLength, indexPackedLength, raw.data());
+            }
+
+            if (result == Z_OK && !decodeIndex(raw.data(), raw.size(), offset, *index))
+            {
+                result = Z_DATA_ERROR;
+            }
+        }
+        catch (const bad_alloc&)
+        {
+            result = Z_MEM_ERROR;
+        }
+    }
+
+    return result;
+}
+
+int walkRecords(istream& is, int magic, RecordHandler& handler, size_t threads, ArchiveIndex* index, FrameSource* source)
+{
+    return (magic == SZIP_MAGIC_LEGACY) ? walkLegacy(is, handler) : walkIndexed(is, handler, threads, index, source);
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <zlib.h>
+
+#include "szip.h"
+
+using namespace std;
+
+// On-disk layout shared by the writer, the extractor and the listing code.
+//
+// Legacy archives:  magic { 12, 29 }, then one zlib stream of records
+//                   (u8 type, u16 name length, name, [u32 size, data]).
+//
+// Indexed archives: magic { 12, 30 }, then frames, then a trailer:
+//     frame    u8 kind, u8 method, u32 raw length, u32 packed length, packed bytes
+//     trailer  u64 offset of the index frame, magic { 12, 30 }
+//   The data frames, concatenated, form a stream of records
+//   (u8 type, u16 name length, name, varint size, varint extra length, extra, data)
+//   that can be extracted front to back. extra holds optional metadata fields, each
+//   u8 tag, varint length, value. A sparse file's data is only its extents, and a hard
+//   link has none. The index frame repeats every record
+//   header together with its data offset and CRC-32, so listing and random access
+//   only have to read the tail of the file.
+
+#define SZIP_MAGIC            12
+#define SZIP_MAGIC_LEGACY     29
+#define SZIP_MAGIC_INDEXED    30
+
+#define FRAME_BLOCK           1
+#define FRAME_INDEX           2
+#define METHOD_STORE          0
+#define METHOD_DEFLATE        1
+#define FRAME_HEADER_SIZE     10
+#define TRAILER_SIZE          10
+#define INDEX_VERSION         1
+
+#define EXTRA_MODE            1     // varint st_mode
+#define EXTRA_MTIME           2     // zigzag varint seconds, varint nanoseconds
+#define EXTRA_TARGET          3     // symlink target bytes, or the entry a hard link refers to
+#define EXTRA_SPARSE          4     // varint length, varint count, count x (varint gap, varint length)
+
+#define SPARSE_EXTENTS_MAX    2048  // keeps EXTRA_SPARSE well inside a record header
+
+#define DEFAULT_BLOCK_SIZE    (1024 * 1024)
+
+struct ArchiveBlock
+{
+    uint64_t offset;        // file offset of the frame header
+    uint64_t rawOffset;     // position of the block's first byte in the record stream
+    uint32_t rawLength;
+    uint32_t packedLength;
+};
+
+struct ArchiveIndex
+{
+    vector<ArchiveBlock> blocks;
+    vector<SzipEntry>    entries;
+    uint64_t             indexOffset;   // where the index frame starts, i.e. the end of the data frames
+
+    ArchiveIndex() : indexOffset(2) {}
+};
+
+class RecordHandler
+{
+
+public:
+
+    virtual ~RecordHandler() {}
+
+    // Each returns false to stop the walk.
+    virtual bool begin(const SzipEntry& entry) = 0;
+    virtual bool data(const unsigned char* data, size_t len) = 0;
+    virtual bool end() = 0;
+};
+
+// Splits a record stream, delivered in arbitrary chunks, into entries.
+class RecordParser
+{
+
+public:
+
+    explicit RecordParser(bool legacy);
+
+    // Returns Z_OK, Z_DATA_ERROR on a malformed stream, or Z_STREAM_END when the handler stops.
+    int  feed(const unsigned char* data, size_t len, RecordHandler& handler);
+    bool atBoundary() const;
+
+private:
+
+    bool parseHeader(bool& complete);
+
+    bool                  legacy;
+    vector<unsigned char> header;
+    SzipEntry             entry;
+    uint64_t              remaining;
+    uint64_t              position;
+    bool                  inData;
+    string                legacyDir;
+};
+
+struct FrameTask;
+
+class ArchiveWriter
+{
+
+public:
+
+    // With threads > 1, up to that many blocks are compressed on the shared pool while
+    // the next one fills; frames are still written strictly in order, so os never seeks.
+    ArchiveWriter(ostream& os, size_t blockSize = DEFAULT_BLOCK_SIZE, int level = Z_DEFAULT_COMPRESSION, int codec = SZIP_CODEC_ZLIB, size_t threads = 1);
+    ~ArchiveWriter();
+
+    // Writes the magic; must precede any entry.
+    int  start();
+
+    // Instead of start(), continues an archive whose index was read back with readIndex().
+    // The new blocks and index overwrite the old index frame, so os must be positioned at
+    // index.indexOffset.
+    int  resume(const ArchiveIndex& index);
+
+    // Adds the header of entry; a file's data follows through data(), entry.size bytes in total.
+    int  begin(const SzipEntry& entry);
+    int  data(const unsigned char* data, size_t len);
+
+    // Returns a writable region of up to len bytes in the current block, for reading
+    // file contents straight into it; commit() accounts for the bytes filled in.
+    unsigned char* reserve(size_t& len);
+    int            commit(size_t len);
+
+    // Starts a new block if the current one is reasonably full, so unrelated groups of
+    // entries don't share a block.
+    int  endGroup();
+
+    // Flushes the last block and writes the index and trailer.
+    int  finish();
+
+    const ArchiveIndex& index() const;
+
+private:
+
+    ArchiveWriter(const ArchiveWriter&);
+    ArchiveWriter& operator=(const ArchiveWriter&);
+
+    int  append(const unsigned char* data, size_t len);
+    int  flushBlock();
+    int  drain(size_t keep);
+    int  writeFrame(unsigned char kind, const unsigned char* raw, size_t rawLength, bool allowStore);
+    int  emitFrame(unsigned char kind, const unsigned char* raw, size_t rawLength, const unsigned char* packed, size_t packedLength, bool allowStore);
+
+    ostream&       os;
+    size_t         blockSize;
+    int            level;
+    int            codec;
+    unsigned char* block;
+    size_t         used;
+    uint64_t       rawPosition;
+    uint64_t       remaining;
+    ArchiveIndex   archive;
+    int            status;
+    size_t         threads;
+    deque<shared_ptr<FrameTask>> pending;   // flushed blocks not written yet, oldest first
+};
+
+void     encodeRecordHeader(const SzipEntry& entry, vector<unsigned char>& buffer);
+void     encodeIndex(const ArchiveIndex& index, vector<unsigned char>& buffer);
+bool     decodeIndex(unsigned char* data, size_t len, uint64_t indexOffset, ArchiveIndex& index);
+
+// Returns SZIP_MAGIC_LEGACY, SZIP_MAGIC_INDEXED, or 0 when the stream is not an archive.
+int      readMagic(istream& is);
+
+// Reads the index of an indexed archive through its trailer; is must be seekable.
+int      readIndex(istream& is, ArchiveIndex& index);
+
+// Reads the frame at the current position; raw must hold rawLength bytes.
+int      readFrameHeader(istream& is, unsigned char& kind, unsigned char& method, uint32_t& rawLength, uint32_t& packedLength);
+int      readFramePayload(istream& is, unsigned char method, uint32_t rawLength, uint32_t packedLength, unsigned char* raw);
+
+// The decoding half of readFramePayload, for a payload already in memory.
+int      decodeFramePayload(unsigned char method, const unsigned char* packed, uint32_t packedLength, unsigned char* raw, uint32_t rawLength);
+
+// Reads at any offset of an archive, from any number of threads at once.
+class FrameSource
+{
+
+public:
+
+    virtual ~FrameSource() {}
+
+    virtual int      read(uint64_t offset, unsigned char* data, size_t len) = 0;
+    virtual uint64_t size() const = 0;
+};
+
+// Walks every record of an archive front to back, starting just past the magic; needs no
+// seeking. Returns Z_OK, Z_STREAM_END when the handler stops, or an error. Indexed archives
+// decode up to threads frames ahead of the handler, and when index is given the walk goes
+// on to read the index frame into it, so a pipe can be checked against its own index.
+// With a source, frames are fetched through it by the decoding threads as well, and is is
+// only left positioned past the index frame.
+int      walkRecords(istream& is, int magic, RecordHandler& handler, size_t threads = 1, ArchiveIndex* index = NULL, FrameSource* source = NULL);
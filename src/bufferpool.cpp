@@ -0,0 +1,104 @@
+#include "bufferpool.h"
+
+#define MIN_POOLED_CAPACITY  (64 * 1024)
+
+BufferPool::BufferPool(size_t retainLimit) : retainedBytes(0), retainLimit(retainLimit)
+{
+
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+unsigned char* BufferPool::acquire(size_t size)
+{
+    size_t capacity = capacityFor(size);
+
+    {
+        lock_guard<mutex> guard(lock);
+        map<size_t, vector<unsigned char*>>::iterator it = idle.find(capacity);
+        if (it != idle.end() && !it->second.empty())
+        {
+            unsigned char* buffer = it->second.back();
+            it->second.pop_back();
+            retainedBytes -= capacity;
+
+            return buffer;
+        }
+    }
+
+    return new unsigned char[capacity];
+}
+
+void BufferPool::release(unsigned char* buffer, size_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    size_t capacity = capacityFor(size);
+
+    {
+        lock_guard<mutex> guard(lock);
+        if (capacity <= retainLimit / 4 && retainedBytes + capacity <= retainLimit)
+        {
+            idle[capacity].push_back(buffer);
+            retainedBytes += capacity;
+
+            return;
+        }
+    }
+
+    delete[] buffer;
+}
+
+size_t BufferPool::retained() const
+{
+    lock_guard<mutex> guard(lock);
+    return retainedBytes;
+}
+
+void BufferPool::trim()
+{
+    lock_guard<mutex> guard(lock);
+
+    for (map<size_t, vector<unsigned char*>>::iterator it = idle.begin(); it != idle.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+        {
+            delete[] it->second[i];
+        }
+    }
+
+    idle.clear();
+    retainedBytes = 0;
+}
+
+BufferPool& BufferPool::shared()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+// private:
+
+// Poolable sizes are rounded up to a power of two so buffers can be reused across
+// slightly different requests; anything too big to retain is allocated exactly.
+size_t BufferPool::capacityFor(size_t size) const
+{
+    if (size > retainLimit / 4)
+    {
+        return size;
+    }
+
+    size_t capacity = MIN_POOLED_CAPACITY;
+    while (capacity < size)
+    {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <mutex>
+
+using namespace std;
+
+// Recycles large scratch buffers between archive jobs so concurrent zip/unzip calls
+// don't each go back to the allocator for tens of megabytes.
+class BufferPool
+{
+
+public:
+
+    explicit BufferPool(size_t retainLimit = 256 * 1024 * 1024);
+    ~BufferPool();
+
+    // The same size must be passed back to release().
+    unsigned char* acquire(size_t size);
+    void           release(unsigned char* buffer, size_t size);
+
+    size_t retained() const;
+    void   trim();
+
+    static BufferPool& shared();
+
+private:
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+    size_t capacityFor(size_t size) const;
+
+    map<size_t, vector<unsigned char*>> idle;
+    size_t                              retainedBytes;
+    size_t                              retainLimit;
+    mutable mutex                       lock;
+};
@@ -1,12 +1,30 @@
 #pragma once
 
 #include <vector>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _MSC_VER
+    #include <stdlib.h>
+#endif
 
 using namespace std;
 
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    #define SZIP_BIG_ENDIAN_HOST  1
+#endif
+
+// The SSSE3 swap is compiled for its own function only and picked at run time, so builds
+// without -mssse3 still get it on CPUs that have it.
+#if !defined(SZIP_BIG_ENDIAN_HOST) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define SZIP_SWAP_SSSE3  1
+    #include <tmmintrin.h>
+#endif
+
 namespace szip
 {
 
+// Fixed-width values are stored big-endian; varints are unsigned LEB128.
 class Bytes
 {
 
@@ -15,53 +33,192 @@ public:
     template <typename T>
     static size_t write(const T& value, vector<unsigned char>& buffer, size_t offset)
     {
-        while (buffer.size() < offset + sizeof(T))
+        if (buffer.size() < offset + sizeof(T))
         {
-            buffer.push_back((unsigned char)0);
+            buffer.resize(offset + sizeof(T));
         }
 
-        unsigned char* p = (unsigned char*)&value;
+        return write<T>(value, buffer.data(), offset);
+    }
 
-        size_t i = 0;
-        while (i < sizeof(T))
+    template <typename T>
+    static size_t write(const T& value, unsigned char* buffer, size_t offset)
+    {
+        typename Word<sizeof(T)>::type word;
+        memcpy(&word, &value, sizeof(T));
+        word = toBigEndian(word);
+        memcpy(buffer + offset, &word, sizeof(T));
+
+        return sizeof(T);
+    }
+
+    template <typename T>
+    static T peek(unsigned char* buffer, size_t offset)
+    {
+        typename Word<sizeof(T)>::type word;
+        memcpy(&word, buffer + offset, sizeof(T));
+        word = toBigEndian(word);
+
+        T t;
+        memcpy(&t, &word, sizeof(T));
+
+        return t;
+    }
+
+    // Bulk forms for tables of fixed-width values, e.g. per-block sizes in an archive index.
+    template <typename T>
+    static size_t writeArray(const T* values, size_t count, unsigned char* buffer, size_t offset)
+    {
+        swapArray<sizeof(T)>((const unsigned char*)values, buffer + offset, count);
+
+        return count * sizeof(T);
+    }
+
+    template <typename T>
+    static size_t writeArray(const T* values, size_t count, vector<unsigned char>& buffer, size_t offset)
+    {
+        if (buffer.size() < offset + count * sizeof(T))
         {
-            buffer[offset + sizeof(T) - i - 1] = p[i];
-            i++;
+            buffer.resize(offset + count * sizeof(T));
         }
 
-        return sizeof(T);
+        return writeArray<T>(values, count, buffer.data(), offset);
     }
 
     template <typename T>
-    static size_t write(const T& value, unsigned char* buffer, size_t offset)
+    static void peekArray(unsigned char* buffer, size_t offset, T* values, size_t count)
     {
-        unsigned char* p = (unsigned char*)&value;
+        swapArray<sizeof(T)>(buffer + offset, (unsigned char*)values, count);
+    }
 
+    static constexpr size_t varintLength(uint64_t value)
+    {
+        return (value < 0x80) ? 1 : 1 + varintLength(value >> 7);
+    }
+
+    static size_t writeVarint(uint64_t value, unsigned char* buffer, size_t offset)
+    {
         size_t i = 0;
-        while (i < sizeof(T))
+        while (value >= 0x80)
         {
-            buffer[offset + sizeof(T) - i - 1] = p[i];
-            i++;
+            buffer[offset + i++] = (unsigned char)(value | 0x80);
+            value >>= 7;
         }
 
-        return sizeof(T);
+        buffer[offset + i++] = (unsigned char)value;
+
+        return i;
     }
 
-    template <typename T>
-    static T peek(unsigned char* buffer, size_t offset)
+    static size_t writeVarint(uint64_t value, vector<unsigned char>& buffer, size_t offset)
     {
-        T t;
-        unsigned char* p = (unsigned char*)&t;
+        if (buffer.size() < offset + varintLength(value))
+        {
+            buffer.resize(offset + varintLength(value));
+        }
 
+        return writeVarint(value, buffer.data(), offset);
+    }
+
+    // Returns the number of bytes consumed, or 0 if the varint is truncated at size or overlong.
+    static size_t peekVarint(const unsigned char* buffer, size_t offset, size_t size, uint64_t& value)
+    {
+        value = 0;
+
+        for (size_t i = 0; i < 10 && offset + i < size; i++)
+        {
+            unsigned char b = buffer[offset + i];
+            value |= (uint64_t)(b & 0x7F) << (7 * i);
+
+            if ((b & 0x80) == 0)
+            {
+                return i + 1;
+            }
+        }
+
+        return 0;
+    }
+
+private:
+
+    template <size_t N> struct Word;
+
+    static inline uint8_t  swap(uint8_t value)  { return value; }
+#ifdef _MSC_VER
+    static inline uint16_t swap(uint16_t value) { return _byteswap_ushort(value); }
+    static inline uint32_t swap(uint32_t value) { return _byteswap_ulong(value); }
+    static inline uint64_t swap(uint64_t value) { return _byteswap_uint64(value); }
+#else
+    static inline uint16_t swap(uint16_t value) { return __builtin_bswap16(value); }
+    static inline uint32_t swap(uint32_t value) { return __builtin_bswap32(value); }
+    static inline uint64_t swap(uint64_t value) { return __builtin_bswap64(value); }
+#endif
+
+    template <typename W>
+    static inline W toBigEndian(W word)
+    {
+#ifdef SZIP_BIG_ENDIAN_HOST
+        return word;
+#else
+        return swap(word);
+#endif
+    }
+
+    // Byte-swaps count N-byte words from src to dst (which may alias), 16 bytes per step where
+    // the CPU has SSSE3.
+    template <size_t N>
+    static void swapArray(const unsigned char* src, unsigned char* dst, size_t count)
+    {
+#ifdef SZIP_BIG_ENDIAN_HOST
+        memmove(dst, src, count * N);
+#else
         size_t i = 0;
-        while (i < sizeof(T))
+
+    #ifdef SZIP_SWAP_SSSE3
+        static const bool ssse3 = __builtin_cpu_supports("ssse3");
+        if (N > 1 && ssse3)
         {
-            p[i] = buffer[offset + sizeof(T) - i - 1];
-            i++;
+            i = swapSsse3<N>(src, dst, count);
         }
+    #endif
 
-        return t;
+        for (; i < count; i++)
+        {
+            typename Word<N>::type word;
+            memcpy(&word, src + i * N, N);
+            word = swap(word);
+            memcpy(dst + i * N, &word, N);
+        }
+#endif
+    }
+
+#ifdef SZIP_SWAP_SSSE3
+    // Returns how many words were swapped; the rest, fewer than 16 bytes, are left to the caller.
+    template <size_t N>
+    __attribute__((target("ssse3"))) static size_t swapSsse3(const unsigned char* src, unsigned char* dst, size_t count)
+    {
+        unsigned char lanes[16];
+        for (size_t j = 0; j < 16; j++)
+        {
+            lanes[j] = (unsigned char)(j - j % N + (N - 1 - j % N));
+        }
+
+        const __m128i mask = _mm_loadu_si128((const __m128i*)lanes);
+        size_t i = 0;
+        for (; i + 16 / N <= count; i += 16 / N)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i * N));
+            _mm_storeu_si128((__m128i*)(dst + i * N), _mm_shuffle_epi8(v, mask));
+        }
+
+        return i;
     }
+#endif
 };
 
+template <> struct Bytes::Word<1> { typedef uint8_t  type; };
+template <> struct Bytes::Word<2> { typedef uint16_t type; };
+template <> struct Bytes::Word<4> { typedef uint32_t type; };
+template <> struct Bytes::Word<8> { typedef uint64_t type; };
+
 }
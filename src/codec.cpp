@@ -0,0 +1,307 @@
+#include <cstring>
+#include <zlib.h>
+
+// Optional: compile with -DSZIP_WITH_LIBDEFLATE and link -ldeflate (https://github.com/ebiggers/libdeflate)
+#ifdef SZIP_WITH_LIBDEFLATE
+    #include <libdeflate.h>
+#endif
+
+#include "szip.h"
+
+#include "codec.h"
+
+#define SCRATCH_SIZE  (64 * 1024)
+
+#ifdef SZIP_WITH_LIBDEFLATE
+
+#define LIBDEFLATE_LEVEL_MAX  12
+
+// libdeflate compressors and decompressors are not thread-safe, but are cheap to keep around.
+struct Deflaters
+{
+    libdeflate_compressor*   compressors[LIBDEFLATE_LEVEL_MAX + 1];
+    libdeflate_decompressor* decompressor;
+
+    Deflaters() : decompressor(NULL)
+    {
+        memset(compressors, 0, sizeof(compressors));
+    }
+
+    ~Deflaters()
+    {
+        for (int i = 0; i <= LIBDEFLATE_LEVEL_MAX; i++)
+        {
+            if (compressors[i] != NULL)  libdeflate_free_compressor(compressors[i]);
+        }
+
+        if (decompressor != NULL)  libdeflate_free_decompressor(decompressor);
+    }
+
+    libdeflate_compressor* compressor(int level)
+    {
+        level = (level < 0) ? 6 : (level > LIBDEFLATE_LEVEL_MAX ? LIBDEFLATE_LEVEL_MAX : level);
+        if (compressors[level] == NULL)
+        {
+            compressors[level] = libdeflate_alloc_compressor(level);
+        }
+
+        return compressors[level];
+    }
+
+    libdeflate_decompressor* inflater()
+    {
+        if (decompressor == NULL)
+        {
+            decompressor = libdeflate_alloc_decompressor();
+        }
+
+        return decompressor;
+    }
+};
+
+static thread_local Deflaters deflaters;
+
+#endif
+
+bool Codec::available(int codec)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    return codec == SZIP_CODEC_ZLIB || codec == SZIP_CODEC_FAST;
+#else
+    return codec == SZIP_CODEC_ZLIB;
+#endif
+}
+
+const char* Codec::name(int codec)
+{
+    return (codec == SZIP_CODEC_FAST && available(codec)) ? "libdeflate" : "zlib";
+}
+
+size_t Codec::bound(int codec, size_t len)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    if (codec == SZIP_CODEC_FAST)
+    {
+        return libdeflate_zlib_compress_bound(NULL, len);
+    }
+#endif
+
+    return compressBound((uLong)len);
+}
+
+int Codec::compress(int codec, int level, const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    if (codec == SZIP_CODEC_FAST)
+    {
+        libdeflate_compressor* compressor = deflaters.compressor(level);
+        if (compressor == NULL)
+        {
+            return Z_MEM_ERROR;
+        }
+
+        size_t n = libdeflate_zlib_compress(compressor, input, len, output, outputLen);
+        if (n == 0)
+        {
+            return Z_BUF_ERROR;
+        }
+
+        outputLen = n;
+        return Z_OK;
+    }
+#endif
+
+    uLongf n = (uLongf)outputLen;
+    int result = compress2(output, &n, input, (uLong)len, (level > 9) ? 9 : level);
+    outputLen = n;
+
+    return result;
+}
+
+int Codec::uncompress(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    libdeflate_decompressor* decompressor = deflaters.inflater();
+    if (decompressor == NULL)
+    {
+        return Z_MEM_ERROR;
+    }
+
+    size_t n = 0;
+    libdeflate_result result = libdeflate_zlib_decompress(decompressor, input, len, output, outputLen, &n);
+    if (result == LIBDEFLATE_INSUFFICIENT_SPACE)
+    {
+        return Z_BUF_ERROR;
+    }
+
+    if (result != LIBDEFLATE_SUCCESS)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    outputLen = n;
+    return Z_OK;
+#else
+    uLongf n = (uLongf)outputLen;
+    int result = ::uncompress(output, &n, input, (uLong)len);
+    outputLen = n;
+
+    return result;
+#endif
+}
+
+uint32_t Codec::crc32(uint32_t crc, const unsigned char* data, size_t len)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    return libdeflate_crc32(crc, data, len);
+#else
+    while (len > 0)
+    {
+        uInt n = (len > 0x40000000) ? 0x40000000 : (uInt)len;
+        crc = (uint32_t)::crc32(crc, data, n);
+        data += n;
+        len -= n;
+    }
+
+    return crc;
+#endif
+}
+
+CodecContext::CodecContext(int codec, int level) : codec(codec), level(level), deflating(false), inflating(false), scratch(NULL)
+{
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+}
+
+CodecContext::~CodecContext()
+{
+    if (deflating)  deflateEnd(&deflater);
+    if (inflating)  inflateEnd(&inflater);
+    delete[] scratch;
+}
+
+int CodecContext::compress(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    if (codec == SZIP_CODEC_FAST)
+    {
+        return Codec::compress(codec, level, input, len, output, outputLen);
+    }
+#endif
+
+    int result = deflating ? deflateReset(&deflater) : deflateInit(&deflater, (level > 9) ? 9 : level);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    deflating = true;
+
+    // avail_in and avail_out are 32-bit, so large buffers go in pieces, as in compress2().
+    const size_t max = (uInt)-1;
+    size_t inLeft = len, outLeft = outputLen;
+
+    deflater.next_in = (Bytef*)input;
+    deflater.avail_in = 0;
+    deflater.next_out = output;
+    deflater.avail_out = 0;
+
+    do
+    {
+        if (deflater.avail_out == 0)
+        {
+            deflater.avail_out = (uInt)((outLeft > max) ? max : outLeft);
+            outLeft -= deflater.avail_out;
+        }
+
+        if (deflater.avail_in == 0)
+        {
+            deflater.avail_in = (uInt)((inLeft > max) ? max : inLeft);
+            inLeft -= deflater.avail_in;
+        }
+
+        result = deflate(&deflater, (inLeft > 0) ? Z_NO_FLUSH : Z_FINISH);
+    }
+    while (result == Z_OK);
+
+    outputLen = deflater.next_out - output;
+
+    return (result == Z_STREAM_END) ? Z_OK : result;
+}
+
+int CodecContext::uncompress(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen)
+{
+#ifdef SZIP_WITH_LIBDEFLATE
+    return Codec::uncompress(input, len, output, outputLen);
+#else
+    return inflateInto(input, len, output, outputLen, false);
+#endif
+}
+
+int CodecContext::uncompressedLength(const unsigned char* input, size_t len, size_t& outputLen)
+{
+    if (scratch == NULL)
+    {
+        scratch = new unsigned char[SCRATCH_SIZE];
+    }
+
+    return inflateInto(input, len, scratch, outputLen, true);
+}
+
+// With discard set, output is reused as a window of SCRATCH_SIZE bytes and outputLen only
+// counts what was produced.
+int CodecContext::inflateInto(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen, bool discard)
+{
+    int result = inflating ? inflateReset(&inflater) : inflateInit(&inflater);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    inflating = true;
+
+    const size_t max = (uInt)-1;
+    size_t inLeft = len, outLeft = discard ? 0 : outputLen, produced = 0;
+
+    inflater.next_in = (Bytef*)input;
+    inflater.avail_in = 0;
+    inflater.next_out = output;
+    inflater.avail_out = 0;
+
+    do
+    {
+        if (inflater.avail_out == 0)
+        {
+            if (discard)
+            {
+                produced += inflater.next_out - output;
+                inflater.next_out = output;
+                inflater.avail_out = SCRATCH_SIZE;
+            }
+            else
+            {
+                inflater.avail_out = (uInt)((outLeft > max) ? max : outLeft);
+                outLeft -= inflater.avail_out;
+            }
+        }
+
+        if (inflater.avail_in == 0)
+        {
+            inflater.avail_in = (uInt)((inLeft > max) ? max : inLeft);
+            inLeft -= inflater.avail_in;
+        }
+
+        result = inflate(&inflater, Z_NO_FLUSH);
+    }
+    while (result == Z_OK);
+
+    outputLen = produced + (inflater.next_out - output);
+
+    if (result == Z_NEED_DICT || (result == Z_BUF_ERROR && (discard || outLeft + inflater.avail_out > 0)))
+    {
+        // Either a preset dictionary we don't have, or the input ended before the stream did.
+        return Z_DATA_ERROR;
+    }
+
+    return (result == Z_STREAM_END) ? Z_OK : result;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <zlib.h>
+
+// Whole-buffer deflate in zlib format. SZIP_CODEC_FAST uses libdeflate when the library is
+// built with SZIP_WITH_LIBDEFLATE (it picks SSE2/PCLMUL/AVX2/BMI2 code paths at runtime)
+// and falls back to zlib otherwise. Either way the output is an ordinary zlib stream, and
+// decompression always uses the fastest decoder built in.
+class Codec
+{
+
+public:
+
+    static bool        available(int codec);
+    static const char* name(int codec);
+
+    static size_t      bound(int codec, size_t len);
+
+    // outputLen holds the capacity of output on entry and the bytes produced on return.
+    // Returns Z_OK, Z_BUF_ERROR if output is too small, or Z_DATA_ERROR / Z_MEM_ERROR.
+    static int         compress  (int codec, int level, const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen);
+    static int         uncompress(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen);
+
+    static uint32_t    crc32(uint32_t crc, const unsigned char* data, size_t len);
+};
+
+// Reusable state for repeated whole-buffer calls, e.g. one per foreign caller or thread. The
+// zlib streams are reset rather than reallocated between calls; libdeflate's state is already
+// kept per thread. Not safe for concurrent use.
+class CodecContext
+{
+
+public:
+
+    CodecContext(int codec, int level);
+    ~CodecContext();
+
+    int  codecId() const { return codec; }
+
+    // Same contract as Codec::compress and Codec::uncompress.
+    int  compress  (const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen);
+    int  uncompress(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen);
+
+    // Inflates into scratch space to find the size uncompress() needs, since zlib streams
+    // don't record it. Returns Z_OK or Z_DATA_ERROR.
+    int  uncompressedLength(const unsigned char* input, size_t len, size_t& outputLen);
+
+private:
+
+    CodecContext(const CodecContext&);
+    CodecContext& operator=(const CodecContext&);
+
+    int  inflateInto(const unsigned char* input, size_t len, unsigned char* output, size_t& outputLen, bool discard);
+
+    int            codec;
+    int            level;
+    z_stream       deflater;
+    z_stream       inflater;
+    bool           deflating;
+    bool           inflating;
+    unsigned char* scratch;
+};
@@ -3,12 +3,18 @@
 #include <fstream>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
 #include <sys/stat.h>
 #include <iterator>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef _WIN32
     #include <direct.h>
     #include <io.h>
+    #include <fcntl.h>
     #ifndef WIN32_LEAN_AND_MEAN
         #define WIN32_LEAN_AND_MEAN
     #endif
@@ -18,17 +24,29 @@
     #include <sys/types.h>
     #include <dirent.h>
     #include <unistd.h>
+    #include <fcntl.h>
 #endif
 
 #ifdef __linux
     #include <string.h>
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <sys/syscall.h>
+    #ifndef FICLONE
+        #define FICLONE _IOW(0x94, 9, int)
+    #endif
 #endif
 #ifdef __APPLE__
     #include <mach-o/dyld.h>
+    #include <copyfile.h>
 #endif
 
+#include "threadpool.h"
+
 #include "filesystem.h"
 
+#define COPY_CHUNK  (1024 * 1024)
+
 bool fileExists(const string& filename)
 {
 #ifdef _MSC_VER
@@ -38,15 +56,39 @@ bool fileExists(const string& filename)
 #endif
 }
 
+// Stat rather than open and seek to the end, which would block on a fifo until a writer came along.
 size_t fileLength(const string& filename)
 {
-    ifstream is;
-    is.open(filename, ios::binary);
-    is.seekg(0, ios::end);
-    size_t len = is.tellg();
-    is.close();
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(filename.c_str(), &st) != 0)
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+#endif
+    {
+        return (size_t)-1;
+    }
+
+    return ((st.st_mode & S_IFMT) == S_IFREG) ? (size_t)st.st_size : 0;
+}
+
+int resizeFile(const string& filename, size_t length)
+{
+#ifdef _WIN32
+    int fd = _open(filename.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0)
+    {
+        return -1;
+    }
 
-    return len;
+    int ret = _chsize_s(fd, (__int64)length);
+    _close(fd);
+
+    return ret;
+#else
+    return truncate(filename.c_str(), (off_t)length);
+#endif
 }
 
 int createDirectory(const string& path)
@@ -62,19 +104,20 @@ int createDirectory(const string& path)
 
 int createDirectories(const string& path)
 {
+    if (path.empty())
+    {
+        return 0;
+    }
+
     string dir = path;
-    if (dir[dir.length() - 1] != '\\' || dir[dir.length() - 1] != '/')
+    if (dir[dir.length() - 1] != '\\' && dir[dir.length() - 1] != '/')
         dir += "/";
 
-    int len = (int)dir.length();
-    char tmp[256] = { 0 };
-
-    for (int i = 0; i < len; ++i)
+    for (size_t i = 0; i < dir.length(); ++i)
     {
-        tmp[i] = dir[i];
-
-        if (tmp[i] == '\\' || tmp[i] == '/')
+        if (dir[i] == '\\' || dir[i] == '/')
         {
+            string tmp = dir.substr(0, i + 1);
             if (!fileExists(tmp))
             {
                 int ret = createDirectory(tmp);
@@ -105,37 +148,193 @@ int removeDirectory(const string& path)
     return 0;
 }
 
+#ifndef _WIN32
+// Copies what the kernel can without passing the data through user space: a reflink on
+// filesystems that share extents (btrfs, xfs, ...), then copy_file_range, then sendfile.
+// Returns the number of bytes copied, which is less than size when a fallback is needed.
+static size_t copyInKernel(int in, int out, size_t size)
+{
+#ifdef __linux
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        return size;
+    }
+
+    size_t copied = 0;
+
+#ifdef __NR_copy_file_range
+    while (copied < size)
+    {
+        ssize_t n = syscall(__NR_copy_file_range, in, NULL, out, NULL, size - copied, 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)  continue;
+            break;
+        }
+
+        copied += n;
+    }
+#endif
+
+    while (copied < size)
+    {
+        off_t offset = (off_t)copied;
+        ssize_t n = sendfile(out, in, &offset, size - copied);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)  continue;
+            break;
+        }
+
+        copied += n;
+    }
+
+    // Both calls advance the output offset; the input offset only moved for copy_file_range.
+    lseek(in, (off_t)copied, SEEK_SET);
+    return copied;
+#elif defined(__APPLE__)
+    return (fcopyfile(in, out, NULL, COPYFILE_DATA) == 0) ? size : 0;
+#else
+    return 0;
+#endif
+}
+#endif
+
 void copyFile(const string& src, const string& dst)
 {
-    ifstream ifs(src, ios::binary);
-    ofstream ofs(dst, ios::binary);
-    ofs << ifs.rdbuf();
+#ifdef _WIN32
+    CopyFileA(src.c_str(), dst.c_str(), FALSE);
+#else
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return;
+    }
+
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0)
+    {
+        close(in);
+        return;
+    }
+
+    struct stat st;
+    bool complete = false;
+    if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        complete = (copyInKernel(in, out, (size_t)st.st_size) == (size_t)st.st_size);
+    }
+
+    // Whatever is left goes through a buffer, as does everything the kernel paths don't
+    // apply to (including procfs-style files that report a size of 0); both offsets already
+    // stand just past what was copied.
+    if (!complete)
+    {
+        vector<char> buffer(COPY_CHUNK);
+        ssize_t n;
+        while ((n = read(in, buffer.data(), buffer.size())) != 0)
+        {
+            if (n < 0 && errno == EINTR)  continue;
+            if (n < 0)  break;
+
+            ssize_t done = 0;
+            while (done < n)
+            {
+                ssize_t w = write(out, buffer.data() + done, n - done);
+                if (w < 0 && errno == EINTR)  continue;
+                if (w <= 0)  break;
+                done += w;
+            }
+
+            if (done < n)  break;
+        }
+    }
+
+    close(out);
+    close(in);
+#endif
 }
 
+// Copies the files of the whole tree in parallel on the shared thread pool. The calling
+// thread takes part as well, so this can't deadlock when called from a pool worker.
 void copyDirectory(const string& src, const string& dst)
 {
     assert(fileExists(src) && isDir(src));
     assert(!fileExists(dst) || isDir(dst));
 
-    if (!fileExists(dst))
+    struct Work
     {
-        createDirectory(dst);
+        vector<pair<string, string>> files;
+        atomic<size_t>               next;
+        size_t                       done;
+        mutex                        lock;
+        condition_variable           finished;
+
+        Work() : next(0), done(0) {}
+
+        void run()
+        {
+            size_t i, completed = 0;
+            while ((i = next++) < files.size())
+            {
+                copyFile(files[i].first, files[i].second);
+                completed++;
+            }
+
+            if (completed > 0)
+            {
+                lock_guard<mutex> guard(lock);
+                done += completed;
+                if (done == files.size())  finished.notify_all();
+            }
+        }
+    };
+
+    shared_ptr<Work> work = make_shared<Work>();
+
+    vector<pair<string, string>> pending(1, make_pair(src, dst));
+    while (!pending.empty())
+    {
+        pair<string, string> dir = pending.back();
+        pending.pop_back();
+
+        if (!fileExists(dir.second))
+        {
+            createDirectory(dir.second);
+        }
+
+        vector<string> files, dirs;
+        getEntries(dir.first, files, dirs);
+
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            work->files.push_back(make_pair(files[i], buildPath(dir.second, baseName(files[i]))));
+        }
+
+        for (size_t i = 0; i < dirs.size(); i++)
+        {
+            pending.push_back(make_pair(dirs[i], buildPath(dir.second, baseName(dirs[i]))));
+        }
+    }
+
+    if (work->files.empty())
+    {
+        return;
     }
 
-    vector<string> files;
-    getFiles(src, files);
-    for (size_t i = 0; i < files.size(); i++)
+    ThreadPool& pool = ThreadPool::shared();
+    size_t helpers = min(pool.size(), work->files.size() - 1);
+    for (size_t i = 0; i < helpers; i++)
     {
-        string name = buildPath(dst, baseName(files[i]));
-        copyFile(files[i], name);
+        pool.post([work]() { work->run(); });
     }
 
-    vector<string> dirs;
-    getDirs(src, dirs);
-    for (size_t i = 0; i < dirs.size(); i++)
+    work->run();
+
+    unique_lock<mutex> guard(work->lock);
+    while (work->done < work->files.size())
     {
-        string name = buildPath(dst, baseName(dirs[i]));
-        copyDirectory(dirs[i], name);
+        work->finished.wait(guard);
     }
 }
 
@@ -364,6 +563,114 @@ void getDirs(const string& path, vector<string>& dirs)
 #endif
 }
 
+// One directory scan for both lists, in the same order getFiles and getDirs report them.
+void getEntries(const string& path, vector<string>& files, vector<string>& dirs)
+{
+#ifdef _WIN32
+    intptr_t handle;
+    _finddata_t fileinfo;
+
+    string dir = path;
+    if (dir[dir.length() - 1] != '\\' || dir[dir.length() - 1] != '/')
+    {
+        dir += "/";
+    }
+    dir += "*.*";
+
+    handle = _findfirst(dir.c_str(), &fileinfo);
+    if (handle == -1)
+    {
+        return;
+    }
+
+    do
+    {
+        if (!(fileinfo.attrib & _A_SUBDIR))
+        {
+            files.push_back(buildPath(path, fileinfo.name));
+        }
+        else if (strcmp(fileinfo.name, ".") && strcmp(fileinfo.name, ".."))
+        {
+            dirs.push_back(buildPath(path, fileinfo.name));
+        }
+    }
+    while (_findnext(handle, &fileinfo) == 0);
+
+    _findclose(handle);
+#else
+    DIR* dir;
+    if (!(dir = opendir(path.c_str())))
+    {
+        assert(false);
+        return;
+    }
+
+    struct dirent* d_ent;
+    string temppath = path;
+    if (temppath[temppath.length() - 1] != '\\' || temppath[temppath.length() - 1] != '/')
+    {
+        temppath += "/";
+    }
+
+    while ((d_ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(d_ent->d_name, ".", 1) == 0 || strncmp(d_ent->d_name, "..", 2) == 0)
+        {
+            continue;
+        }
+
+        string name = temppath + d_ent->d_name;
+        bool directory;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (d_ent->d_type != DT_UNKNOWN)
+        {
+            directory = (d_ent->d_type == DT_DIR);
+        }
+        else
+#endif
+        {
+            // Only some filesystems leave the type out of the directory entry.
+            struct stat file_stat;
+            if (lstat(name.c_str(), &file_stat) < 0)
+            {
+                assert(false);
+                continue;
+            }
+
+            directory = S_ISDIR(file_stat.st_mode);
+        }
+
+        (directory ? dirs : files).push_back(name);
+    }
+
+    closedir(dir);
+#endif
+}
+
+#ifndef _WIN32
+string readLink(const string& path)
+{
+    vector<char> buf(256);
+
+    while (true)
+    {
+        ssize_t len = readlink(path.c_str(), buf.data(), buf.size());
+        if (len < 0)
+        {
+            return "";
+        }
+
+        if ((size_t)len < buf.size())
+        {
+            return string(buf.data(), len);
+        }
+
+        buf.resize(buf.size() * 2);
+    }
+}
+#endif
+
 #ifdef _WIN32
 #ifdef _MSC_VER
 string thisExePath()
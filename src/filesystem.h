@@ -7,6 +7,7 @@ using namespace std;
 
 bool        fileExists(const string& filename);
 size_t      fileLength(const string& filename);
+int         resizeFile(const string& filename, size_t length);
 int         createDirectory(const string& path);
 int         createDirectories(const string& path);
 int         removeDirectory(const string& path);
@@ -19,7 +20,11 @@ bool        isDir(const string& name);
 bool        isFile(const string& name);
 void        getFiles(const string& path, vector<string>& files);
 void        getDirs(const string& path, vector<string>& dirs);
+void        getEntries(const string& path, vector<string>& files, vector<string>& dirs);
 string      thisExePath();
+#ifndef _WIN32
+string      readLink(const string& path);
+#endif
 #ifdef _WIN32
 bool        isUtf8(const void* data, size_t size);
 string      ansi2utf8(const string& ansi);
@@ -0,0 +1,318 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <new>
+#include <exception>
+#include <zlib.h>
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+    #define isatty _isatty
+    #define fileno _fileno
+#else
+    #include <unistd.h>
+#endif
+
+#include "filesystem.h"
+#include "volume.h"
+
+#include "szip.h"
+
+using namespace std;
+
+#define BLOCK_SIZE_MAX  (64 * 1024 * 1024)
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: szipc c [options] ARCHIVE SOURCE   create ARCHIVE from a directory or file\n"
+        "       szipc x [options] ARCHIVE [DIR]    extract ARCHIVE into DIR (default .)\n"
+        "       szipc l ARCHIVE                    list the entries of ARCHIVE\n"
+        "       szipc t [options] ARCHIVE          check ARCHIVE without extracting it\n"
+        "\n"
+        "ARCHIVE may be - for standard output (c) or standard input (x, l, t). A split\n"
+        "archive is named without its .001, .002, ... suffixes.\n"
+        "\n"
+        "options:\n"
+        "  -j N      threads compressing or decoding blocks (default: one per core)\n"
+        "  -l N      compression level, 0-9, or up to 12 with -c fast (default: 6)\n"
+        "  -c CODEC  zlib or fast; fast uses libdeflate when built in (default: zlib)\n"
+        "  -b SIZE   block size in bytes, with an optional K or M suffix (default: 1M)\n"
+        "  -o ORDER  natural, grouped or content: how files are laid out in blocks\n"
+        "  -v SIZE   split the archive into volumes of SIZE bytes (K, M or G suffix)\n"
+        "  -u        on extraction, leave files that already match the archive alone\n");
+}
+
+static const char* describe(int result)
+{
+    switch (result)
+    {
+        case Z_ERRNO:        return "read or write failed";
+        case Z_DATA_ERROR:   return "archive is damaged or truncated";
+        case Z_STREAM_ERROR: return "not supported for this archive";
+        case Z_MEM_ERROR:    return "out of memory";
+        case Z_BUF_ERROR:    return "entry too large";
+        default:             return "failed";
+    }
+}
+
+static bool parseNumber(const char* text, long long minimum, long long maximum, long long& value)
+{
+    char* end = NULL;
+    value = strtoll(text, &end, 10);
+    if (end == text)
+    {
+        return false;
+    }
+
+    long long multiplier = 1;
+    if (*end == 'k' || *end == 'K')
+    {
+        multiplier = 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        multiplier = 1024 * 1024;
+        end++;
+    }
+    else if (*end == 'g' || *end == 'G')
+    {
+        multiplier = 1024 * 1024 * 1024;
+        end++;
+    }
+
+    // Range check before multiplying, so a large value can't overflow into range.
+    if (*end != '\0' || value < minimum / multiplier || value > maximum / multiplier)
+    {
+        return false;
+    }
+
+    value *= multiplier;
+
+    return value >= minimum && value <= maximum;
+}
+
+static string typeName(const SzipEntry& entry)
+{
+    switch (entry.type)
+    {
+        case PUT_DIR_T:      return "d";
+        case PUT_LINK_T:     return "l";
+        case PUT_HARDLINK_T: return "h";
+        default:             return "-";
+    }
+}
+
+static void print(const SzipEntry& entry)
+{
+    char when[32] = "-";
+    if (entry.mode != 0)
+    {
+        time_t t = (time_t)entry.mtime;
+        struct tm* local = localtime(&t);
+        if (local != NULL)
+        {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", local);
+        }
+    }
+
+    uint64_t size = (entry.sparseLength > 0) ? entry.sparseLength : entry.size;
+    printf("%s %04o %12llu %16s  %s", typeName(entry).c_str(), entry.mode & 07777, (unsigned long long)size, when, entry.name.c_str());
+
+    if (entry.type == PUT_LINK_T)
+    {
+        printf(" -> %s", entry.target.c_str());
+    }
+    else if (entry.type == PUT_HARDLINK_T)
+    {
+        printf(" => %s", entry.target.c_str());
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || strlen(argv[1]) != 1 || strchr("cxlt", argv[1][0]) == NULL)
+    {
+        usage();
+        return 2;
+    }
+
+    char command = argv[1][0];
+    unsigned cores = thread::hardware_concurrency();
+
+    ZipOptions zipOptions;
+    UnzipOptions unzipOptions;
+    zipOptions.threads = unzipOptions.threads = (cores > 0) ? cores : 1;
+
+    vector<string> operands;
+    for (int i = 2; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.length() < 2 || arg[0] != '-')
+        {
+            operands.push_back(arg);
+            continue;
+        }
+
+        // Every option but -u takes a value.
+        const char* value = (arg != "-u" && i + 1 < argc) ? argv[++i] : NULL;
+        long long n = 0;
+
+        if (arg == "-u" && command == 'x')
+        {
+            unzipOptions.skipUnchanged = true;
+        }
+        else if (arg == "-j" && value != NULL && parseNumber(value, 1, 256, n))
+        {
+            zipOptions.threads = unzipOptions.threads = (size_t)n;
+        }
+        else if (arg == "-l" && value != NULL && parseNumber(value, 0, 12, n))
+        {
+            zipOptions.level = (int)n;
+        }
+        else if (arg == "-b" && value != NULL && parseNumber(value, 1, BLOCK_SIZE_MAX, n))
+        {
+            zipOptions.blockSize = (size_t)n;
+        }
+        else if (arg == "-v" && value != NULL && parseNumber(value, 1, (1LL << 50), n))
+        {
+            zipOptions.volumeSize = (uint64_t)n;
+        }
+        else if (arg == "-c" && value != NULL && (strcmp(value, "zlib") == 0 || strcmp(value, "fast") == 0))
+        {
+            zipOptions.codec = (strcmp(value, "fast") == 0) ? SZIP_CODEC_FAST : SZIP_CODEC_ZLIB;
+        }
+        else if (arg == "-o" && value != NULL && (strcmp(value, "natural") == 0 || strcmp(value, "grouped") == 0 || strcmp(value, "content") == 0))
+        {
+            zipOptions.order = (strcmp(value, "natural") == 0) ? SZIP_ORDER_NATURAL : (strcmp(value, "grouped") == 0 ? SZIP_ORDER_GROUPED : SZIP_ORDER_CONTENT);
+        }
+        else
+        {
+            fprintf(stderr, "szipc: bad option %s%s%s\n", arg.c_str(), value != NULL ? " " : "", value != NULL ? value : "");
+            usage();
+            return 2;
+        }
+    }
+
+    if (zipOptions.level > 9 && zipOptions.codec != SZIP_CODEC_FAST)
+    {
+        fprintf(stderr, "szipc: levels above 9 need -c fast\n");
+        usage();
+        return 2;
+    }
+
+    size_t required = (command == 'c') ? 2 : 1;
+    size_t allowed = (command == 'l' || command == 't') ? 1 : 2;
+    if (operands.size() < required || operands.size() > allowed)
+    {
+        usage();
+        return 2;
+    }
+
+    const string& archive = operands[0];
+    bool piped = (archive == "-");
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    // The library reports failures as zlib codes, but the standard library may still throw,
+    // most likely bad_alloc on a damaged archive; report it rather than abort.
+    int result = Z_OK;
+    try
+    {
+        switch (command)
+        {
+            case 'c':
+            {
+                const string& source = operands[1];
+                if (!fileExists(source))
+                {
+                    fprintf(stderr, "szipc: %s: no such file or directory\n", source.c_str());
+                    return 1;
+                }
+
+                if (piped && zipOptions.volumeSize > 0)
+                {
+                    fprintf(stderr, "szipc: volumes are files, they can't go to standard output\n");
+                    return 1;
+                }
+
+                if (piped && isatty(fileno(stdout)))
+                {
+                    fprintf(stderr, "szipc: not writing an archive to a terminal\n");
+                    return 1;
+                }
+
+                result = piped ? Szip::zip(source, cout, zipOptions) : Szip::zip(source, archive, zipOptions);
+                break;
+            }
+
+            case 'x':
+            {
+                string output = (operands.size() > 1) ? operands[1] : ".";
+                if (!piped && !fileExists(archive) && !fileExists(volumeName(archive, 1)))
+                {
+                    fprintf(stderr, "szipc: %s: no such file\n", archive.c_str());
+                    return 1;
+                }
+
+                result = piped ? Szip::unzip(cin, output, unzipOptions) : Szip::unzip(archive, output, unzipOptions);
+                break;
+            }
+
+            case 'l':
+            {
+                vector<SzipEntry> entries;
+                result = piped ? Szip::list(cin, entries) : Szip::list(archive, entries);
+                for (size_t i = 0; result == Z_OK && i < entries.size(); i++)
+                {
+                    print(entries[i]);
+                }
+                break;
+            }
+
+            case 't':
+            {
+                result = piped ? Szip::test(cin, unzipOptions.threads) : Szip::test(archive, unzipOptions.threads);
+                if (result == Z_OK)
+                {
+                    fprintf(stderr, "%s: ok\n", piped ? "(stdin)" : archive.c_str());
+                }
+                break;
+            }
+        }
+    }
+    catch (const bad_alloc&)
+    {
+        result = Z_MEM_ERROR;
+    }
+    catch (const exception& e)
+    {
+        fprintf(stderr, "szipc: %s: %s\n", piped ? "(stdin)" : archive.c_str(), e.what());
+        return 1;
+    }
+    catch (...)
+    {
+        fprintf(stderr, "szipc: %s: unexpected error\n", piped ? "(stdin)" : archive.c_str());
+        return 1;
+    }
+
+    if (result != Z_OK)
+    {
+        fprintf(stderr, "szipc: %s: %s\n", piped ? "(stdin)" : archive.c_str(), describe(result));
+        return 1;
+    }
+
+    return 0;
+}
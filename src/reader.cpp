@@ -0,0 +1,380 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "codec.h"
+
+#include "reader.h"
+
+BlockCache::BlockCache(size_t capacity) : limit(capacity), bytes(0), hitCount(0), missCount(0)
+{
+
+}
+
+CachedBlock BlockCache::find(const string& archive, uint64_t offset)
+{
+    lock_guard<mutex> guard(lock);
+
+    Key key = { archive, offset };
+    unordered_map<Key, Blocks::iterator, KeyHash>::iterator it = lookup.find(key);
+    if (it == lookup.end())
+    {
+        missCount++;
+        return CachedBlock();
+    }
+
+    hitCount++;
+    blocks.splice(blocks.begin(), blocks, it->second);
+
+    return it->second->second;
+}
+
+void BlockCache::insert(const string& archive, uint64_t offset, const CachedBlock& block)
+{
+    lock_guard<mutex> guard(lock);
+
+    if (block->size() > limit)
+    {
+        return;
+    }
+
+    // Another reader may have decoded the same block meanwhile; keep the first copy.
+    Key key = { archive, offset };
+    if (lookup.count(key) != 0)
+    {
+        return;
+    }
+
+    blocks.push_front(make_pair(key, block));
+    lookup[key] = blocks.begin();
+    bytes += block->size();
+
+    evict();
+}
+
+void BlockCache::setCapacity(size_t capacity)
+{
+    lock_guard<mutex> guard(lock);
+
+    limit = capacity;
+    evict();
+}
+
+void BlockCache::clear()
+{
+    lock_guard<mutex> guard(lock);
+
+    blocks.clear();
+    lookup.clear();
+    bytes = 0;
+}
+
+size_t BlockCache::capacity() const
+{
+    lock_guard<mutex> guard(lock);
+    return limit;
+}
+
+size_t BlockCache::used() const
+{
+    lock_guard<mutex> guard(lock);
+    return bytes;
+}
+
+uint64_t BlockCache::hits() const
+{
+    lock_guard<mutex> guard(lock);
+    return hitCount;
+}
+
+uint64_t BlockCache::misses() const
+{
+    lock_guard<mutex> guard(lock);
+    return missCount;
+}
+
+BlockCache& BlockCache::shared()
+{
+    static BlockCache cache;
+    return cache;
+}
+
+// private:
+
+// Called with lock held.
+void BlockCache::evict()
+{
+    while (bytes > limit && !blocks.empty())
+    {
+        bytes -= blocks.back().second->size();
+        lookup.erase(blocks.back().first);
+        blocks.pop_back();
+    }
+}
+
+// Tells apart different files that have been at the same path: device, inode, size and
+// modification time, to the nanosecond where the platform keeps it.
+static string fileIdentity(const string& filename)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+    {
+        return string();
+    }
+
+    long long nanoseconds = 0;
+#if defined(__APPLE__)
+    nanoseconds = st.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+    nanoseconds = st.st_mtim.tv_nsec;
+#endif
+
+    return to_string((unsigned long long)st.st_dev) + ':' + to_string((unsigned long long)st.st_ino) + ':' +
+           to_string((long long)st.st_size) + ':' + to_string((long long)st.st_mtime) + '.' + to_string(nanoseconds);
+}
+
+SzipReader::SzipReader(BlockCache& cache) : cache(cache)
+{
+
+}
+
+int SzipReader::open(const string& szipFilename)
+{
+    lock_guard<mutex> guard(lock);
+
+    is.close();
+    is.clear();
+    is.open(szipFilename, ios::binary);
+
+    int magic = readMagic(is);
+    if (magic != SZIP_MAGIC_INDEXED)
+    {
+        return (magic == SZIP_MAGIC_LEGACY) ? Z_STREAM_ERROR : (is.is_open() ? Z_DATA_ERROR : Z_ERRNO);
+    }
+
+    index = ArchiveIndex();
+    int result = readIndex(is, index);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    // An archive rewritten or appended to at the same path has a new modification time and
+    // usually a new size and index offset, so it never shares cache entries with an old copy.
+    key = szipFilename + '\0' + to_string(index.indexOffset) + '\0' + fileIdentity(szipFilename);
+
+    // A later record of the same name wins, as it does on extraction.
+    names.clear();
+    try
+    {
+        for (size_t i = 0; i < index.entries.size(); i++)
+        {
+            names[index.entries[i].name] = i;
+        }
+    }
+    catch (const bad_alloc&)
+    {
+        names.clear();
+        index = ArchiveIndex();
+        return Z_MEM_ERROR;
+    }
+
+    return Z_OK;
+}
+
+const vector<SzipEntry>& SzipReader::entries() const
+{
+    return index.entries;
+}
+
+int SzipReader::read(const string& name, vector<unsigned char>& data)
+{
+    unordered_map<string, size_t>::const_iterator it = names.find(name);
+    if (it == names.end())
+    {
+        return Z_STREAM_END;
+    }
+
+    return read(index.entries[it->second], data);
+}
+
+int SzipReader::read(const SzipEntry& entry, vector<unsigned char>& data)
+{
+    data.clear();
+    if (entry.type == PUT_HARDLINK_T)
+    {
+        // Links always refer to an earlier file entry, never to another link.
+        unordered_map<string, size_t>::const_iterator it = names.find(entry.target);
+        if (it == names.end() || index.entries[it->second].type != PUT_FILE_T)
+        {
+            return Z_DATA_ERROR;
+        }
+
+        return read(index.entries[it->second], data);
+    }
+
+    if (entry.type != PUT_FILE_T)
+    {
+        return Z_OK;
+    }
+
+    int result = readStored(entry, data);
+    if (result != Z_OK || entry.sparseLength == 0)
+    {
+        return result;
+    }
+
+    // The length comes from the archive; don't let a damaged one throw out of here.
+    if (entry.sparseLength > data.max_size())
+    {
+        return Z_MEM_ERROR;
+    }
+
+    try
+    {
+        data.resize((size_t)entry.sparseLength);
+    }
+    catch (const bad_alloc&)
+    {
+        return Z_MEM_ERROR;
+    }
+
+    // Put the holes back in place, moving the stored extents out to their offsets last one
+    // first; an extent never starts before the data stored ahead of it ends.
+    size_t position = (size_t)entry.size;
+    for (size_t i = entry.extents.size(); i-- > 0; )
+    {
+        const SzipExtent& extent = entry.extents[i];
+        position -= (size_t)extent.length;
+        memmove(data.data() + extent.offset, data.data() + position, (size_t)extent.length);
+    }
+
+    uint64_t end = 0;
+    for (size_t i = 0; i <= entry.extents.size(); i++)
+    {
+        uint64_t next = (i < entry.extents.size()) ? entry.extents[i].offset : entry.sparseLength;
+        memset(data.data() + end, 0, (size_t)(next - end));
+        if (i < entry.extents.size())  end = next + entry.extents[i].length;
+    }
+
+    return Z_OK;
+}
+
+// private:
+
+int SzipReader::readStored(const SzipEntry& entry, vector<unsigned char>& data)
+{
+    if (entry.size == 0)
+    {
+        return Z_OK;
+    }
+
+    // The last block starting at or before the data holds its first byte.
+    struct StartsAfter
+    {
+        bool operator()(uint64_t offset, const ArchiveBlock& b) const { return offset < b.rawOffset; }
+    };
+
+    const vector<ArchiveBlock>& blocks = index.blocks;
+    size_t i = upper_bound(blocks.begin(), blocks.end(), entry.offset, StartsAfter()) - blocks.begin();
+    if (i == 0)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    // Check the size against the blocks before reserving room for it.
+    uint64_t position = entry.offset, end = entry.offset + entry.size;
+    if (end < position || end > blocks.back().rawOffset + blocks.back().rawLength)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    try
+    {
+        data.reserve((size_t)entry.size);
+    }
+    catch (const bad_alloc&)
+    {
+        return Z_MEM_ERROR;
+    }
+
+    for (i--; position < end; i++)
+    {
+        if (i >= blocks.size())
+        {
+            return Z_DATA_ERROR;
+        }
+
+        CachedBlock raw;
+        int result = block(i, raw);
+        if (result != Z_OK)
+        {
+            return result;
+        }
+
+        uint64_t from = position - blocks[i].rawOffset;
+        uint64_t n = min<uint64_t>(end - position, blocks[i].rawLength - from);
+        data.insert(data.end(), raw->begin() + from, raw->begin() + from + n);
+        position += n;
+    }
+
+    return (Codec::crc32(0, data.data(), data.size()) == entry.crc) ? Z_OK : Z_DATA_ERROR;
+}
+
+int SzipReader::block(size_t i, CachedBlock& raw)
+{
+    const ArchiveBlock& b = index.blocks[i];
+
+    raw = cache.find(key, b.offset);
+    if (raw)
+    {
+        return Z_OK;
+    }
+
+    // Only the read itself is serialized; decoding runs in parallel with other readers.
+    vector<unsigned char> packed;
+    shared_ptr<vector<unsigned char>> decoded;
+    unsigned char kind, method;
+    uint32_t rawLength, packedLength;
+    try
+    {
+        {
+            lock_guard<mutex> guard(lock);
+
+            is.clear();
+            is.seekg(b.offset);
+            int result = readFrameHeader(is, kind, method, rawLength, packedLength);
+            if (result != Z_OK || kind != FRAME_BLOCK || rawLength != b.rawLength || packedLength != b.packedLength)
+            {
+                return Z_DATA_ERROR;
+            }
+
+            packed.resize(packedLength);
+            is.read((char*)packed.data(), packedLength);
+            if ((uint32_t)is.gcount() != packedLength)
+            {
+                return Z_DATA_ERROR;
+            }
+        }
+
+        decoded = make_shared<vector<unsigned char>>(rawLength);
+    }
+    catch (const bad_alloc&)
+    {
+        return Z_MEM_ERROR;
+    }
+
+    int result = decodeFramePayload(method, packed.data(), packedLength, decoded->data(), rawLength);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    raw = decoded;
+    cache.insert(key, b.offset, raw);
+
+    return Z_OK;
+}
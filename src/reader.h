@@ -0,0 +1,112 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <cstdint>
+#include <unordered_map>
+
+#include "szip.h"
+#include "archive.h"
+
+using namespace std;
+
+typedef shared_ptr<const vector<unsigned char>> CachedBlock;
+
+// Decompressed archive blocks, least recently used evicted first once the total exceeds the
+// capacity. Blocks are handed out by shared pointer, so an evicted block stays valid for
+// whoever is still copying out of it.
+class BlockCache
+{
+
+public:
+
+    explicit BlockCache(size_t capacity = 64 * 1024 * 1024);
+
+    // Returns an empty pointer on a miss.
+    CachedBlock find(const string& archive, uint64_t offset);
+
+    // A block larger than the whole capacity is not kept.
+    void        insert(const string& archive, uint64_t offset, const CachedBlock& block);
+
+    void     setCapacity(size_t bytes);
+    void     clear();
+    size_t   capacity() const;
+    size_t   used() const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+    static BlockCache& shared();
+
+private:
+
+    struct Key
+    {
+        string   archive;
+        uint64_t offset;
+
+        bool operator==(const Key& other) const { return offset == other.offset && archive == other.archive; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const { return hash<string>()(key.archive) ^ hash<uint64_t>()(key.offset); }
+    };
+
+    typedef list<pair<Key, CachedBlock>> Blocks;
+
+    BlockCache(const BlockCache&);
+    BlockCache& operator=(const BlockCache&);
+
+    void evict();
+
+    Blocks                                           blocks;    // most recently used first
+    unordered_map<Key, Blocks::iterator, KeyHash>    lookup;
+    size_t                                           limit;
+    size_t                                           bytes;
+    uint64_t                                         hitCount;
+    uint64_t                                         missCount;
+    mutable mutex                                    lock;
+};
+
+// Random access to the entries of an indexed archive, for services that serve many small
+// entries out of the same archive. Blocks come from the cache when they can; reads are safe
+// from any number of threads once open() has returned.
+class SzipReader
+{
+
+public:
+
+    explicit SzipReader(BlockCache& cache = BlockCache::shared());
+
+    // Reads the index. Legacy archives have none and return Z_STREAM_ERROR; an index too
+    // large for memory returns Z_MEM_ERROR.
+    int  open(const string& szipFilename);
+
+    const vector<SzipEntry>& entries() const;
+
+    // Returns Z_STREAM_END if name is not in the archive, Z_DATA_ERROR if the data doesn't
+    // match its recorded CRC-32, Z_MEM_ERROR if it doesn't fit in memory. Hard links read as
+    // the file they refer to.
+    int  read(const string& name, vector<unsigned char>& data);
+    int  read(const SzipEntry& entry, vector<unsigned char>& data);
+
+private:
+
+    SzipReader(const SzipReader&);
+    SzipReader& operator=(const SzipReader&);
+
+    // The entry's data as archived, without the holes of a sparse file.
+    int  readStored(const SzipEntry& entry, vector<unsigned char>& data);
+    int  block(size_t i, CachedBlock& raw);
+
+    BlockCache&                    cache;
+    string                         key;     // identifies this archive's blocks in the cache
+    ifstream                       is;
+    ArchiveIndex                   index;
+    unordered_map<string, size_t>  names;
+    mutex                          lock;    // guards is
+};
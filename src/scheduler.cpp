@@ -0,0 +1,205 @@
+#include "szip.h"
+
+#include "scheduler.h"
+
+#define DEFAULT_MEMORY_BUDGET  ((size_t)1024 * 1024 * 1024)
+#define MAX_BYPASSED           32
+
+Scheduler::Scheduler(size_t memoryBudget, size_t ioSlots, ThreadPool* pool) :
+    pool(pool != NULL ? *pool : ThreadPool::shared()), memoryBudget(0), memoryUsed(0), ioSlots(0), active(0)
+{
+    setMemoryBudget(memoryBudget);
+    setIoSlots(ioSlots);
+}
+
+Scheduler::~Scheduler()
+{
+    unique_lock<mutex> guard(lock);
+
+    // Jobs that never started see a broken promise; running ones still reference this scheduler.
+    pending.clear();
+    while (active > 0)
+    {
+        idle.wait(guard);
+    }
+}
+
+future<int> Scheduler::zip(const string& sourceDirOrFileName, const string& outputFilename)
+{
+    return zip(sourceDirOrFileName, outputFilename, ZipOptions());
+}
+
+future<int> Scheduler::unzip(const string& szipFilename, const string& outputPath)
+{
+    return unzip(szipFilename, outputPath, UnzipOptions());
+}
+
+future<int> Scheduler::zip(const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options)
+{
+    size_t size = 0;
+    size_t memory = Szip::estimateZipMemory(sourceDirOrFileName, options, size);
+
+    return submit([sourceDirOrFileName, outputFilename, options]() { return Szip::zip(sourceDirOrFileName, outputFilename, options); }, memory, size);
+}
+
+future<int> Scheduler::unzip(const string& szipFilename, const string& outputPath, const UnzipOptions& options)
+{
+    size_t size = 0;
+    size_t memory = Szip::estimateUnzipMemory(szipFilename, options, size);
+
+    return submit([szipFilename, outputPath, options]() { return Szip::unzip(szipFilename, outputPath, options); }, memory, size);
+}
+
+future<int> Scheduler::submit(const function<int()>& job, size_t memory, size_t size)
+{
+    Job pendingJob;
+    pendingJob.run      = job;
+    pendingJob.result   = make_shared<promise<int>>();
+    pendingJob.memory   = memory;
+    pendingJob.size     = size;
+    pendingJob.bypassed = 0;
+
+    future<int> result = pendingJob.result->get_future();
+
+    {
+        lock_guard<mutex> guard(lock);
+        pending.push_back(pendingJob);
+    }
+
+    pump();
+
+    return result;
+}
+
+void Scheduler::setMemoryBudget(size_t bytes)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        memoryBudget = (bytes > 0) ? bytes : DEFAULT_MEMORY_BUDGET;
+    }
+
+    pump();
+}
+
+void Scheduler::setIoSlots(size_t slots)
+{
+    if (slots == 0)
+    {
+        slots = thread::hardware_concurrency();
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        ioSlots = (slots > 0) ? slots : 1;
+    }
+
+    pump();
+}
+
+size_t Scheduler::memoryInUse() const
+{
+    lock_guard<mutex> guard(lock);
+    return memoryUsed;
+}
+
+size_t Scheduler::activeJobs() const
+{
+    lock_guard<mutex> guard(lock);
+    return active;
+}
+
+size_t Scheduler::pendingJobs() const
+{
+    lock_guard<mutex> guard(lock);
+    return pending.size();
+}
+
+Scheduler& Scheduler::shared()
+{
+    static Scheduler scheduler;
+    return scheduler;
+}
+
+// private:
+
+void Scheduler::pump()
+{
+    lock_guard<mutex> guard(lock);
+    admit();
+}
+
+// Called with the lock held.
+void Scheduler::admit()
+{
+    while (active < ioSlots && !pending.empty())
+    {
+        size_t next = 0;
+        for (size_t i = 1; i < pending.size(); i++)
+        {
+            if (pending[next].bypassed >= MAX_BYPASSED)
+            {
+                break;
+            }
+
+            if (pending[i].bypassed >= MAX_BYPASSED || pending[i].size < pending[next].size)
+            {
+                next = i;
+            }
+        }
+
+        Job& job = pending[next];
+        if (active > 0 && memoryUsed + job.memory > memoryBudget)
+        {
+            // Wait for memory to be returned rather than letting smaller jobs starve this one.
+            break;
+        }
+
+        for (size_t i = 0; i < next; i++)
+        {
+            pending[i].bypassed++;
+        }
+
+        Job admitted = job;
+        pending.erase(pending.begin() + next);
+        memoryUsed += admitted.memory;
+        active++;
+
+        pool.post([this, admitted]()
+        {
+            int result = 0;
+            exception_ptr error;
+
+            try
+            {
+                result = admitted.run();
+            }
+            catch (...)
+            {
+                error = current_exception();
+            }
+
+            // Return the budget before waking the caller so its view of the scheduler is settled.
+            finish(admitted.memory);
+
+            if (error)
+            {
+                admitted.result->set_exception(error);
+            }
+            else
+            {
+                admitted.result->set_value(result);
+            }
+        });
+    }
+}
+
+void Scheduler::finish(size_t memory)
+{
+    lock_guard<mutex> guard(lock);
+    memoryUsed -= memory;
+    active--;
+    admit();
+
+    // Notify under the lock: once it is released the destructor may already have returned.
+    idle.notify_all();
+}
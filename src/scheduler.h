@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include "szip.h"
+#include "threadpool.h"
+
+using namespace std;
+
+// Admits archive jobs against a global memory budget and a cap on concurrently running
+// (I/O bound) jobs, then runs them on a shared worker pool. Pending jobs are started
+// smallest first; a job passed over too many times is started next regardless of size.
+class Scheduler
+{
+
+public:
+
+    // memoryBudget == 0 means 1 GiB, ioSlots == 0 means one slot per hardware thread.
+    Scheduler(size_t memoryBudget = 0, size_t ioSlots = 0, ThreadPool* pool = NULL);
+    ~Scheduler();
+
+    future<int> zip  (const string& sourceDirOrFileName, const string& outputFilename);
+    future<int> unzip(const string& szipFilename, const string& outputPath);
+
+    // The job's memory is estimated from the options, so more threads or larger blocks claim
+    // more of the budget.
+    future<int> zip  (const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options);
+    future<int> unzip(const string& szipFilename, const string& outputPath, const UnzipOptions& options);
+
+    // memory: peak bytes the job will hold; size: its input size, used to order pending jobs.
+    // A job larger than the whole budget is only started once nothing else is running.
+    future<int> submit(const function<int()>& job, size_t memory, size_t size);
+
+    void   setMemoryBudget(size_t bytes);
+    void   setIoSlots(size_t slots);
+    size_t memoryInUse() const;
+    size_t activeJobs() const;
+    size_t pendingJobs() const;
+
+    static Scheduler& shared();
+
+private:
+
+    struct Job
+    {
+        function<int()>          run;
+        shared_ptr<promise<int>> result;
+        size_t                   memory;
+        size_t                   size;
+        size_t                   bypassed;
+    };
+
+    Scheduler(const Scheduler&);
+    Scheduler& operator=(const Scheduler&);
+
+    void pump();
+    void admit();
+    void finish(size_t memory);
+
+    ThreadPool&         pool;
+    vector<Job>         pending;
+    size_t              memoryBudget;
+    size_t              memoryUsed;
+    size_t              ioSlots;
+    size_t              active;
+    mutable mutex       lock;
+    condition_variable  idle;
+};
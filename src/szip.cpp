@@ -2,12 +2,24 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <cerrno>
+#include <cctype>
 // The zlib library must be installed, for example(for macos): brew install zlib
 // link flag: -lz
 #include <zlib.h>
 
 #include "bytes.h"
 #include "filesystem.h"
+#include "threadpool.h"
+#include "bufferpool.h"
+#include "archive.h"
+#include "codec.h"
+#include "volume.h"
 
 #include "szip.h"
 
@@ -27,8 +39,18 @@
 extern "C"
 {
 #endif
-void DLL_EXPORT zip(char* sourceDirOrFileName, char* outputFilename);
-void DLL_EXPORT unzip(char* szipFilename, char* outputPath);
+typedef void (__stdcall *SzipCallback)(int result, void* userData);
+typedef struct SzipContext SzipContext;
+int  DLL_EXPORT zip(char* sourceDirOrFileName, char* outputFilename);
+int  DLL_EXPORT unzip(char* szipFilename, char* outputPath);
+void DLL_EXPORT zipAsync(char* sourceDirOrFileName, char* outputFilename, SzipCallback callback, void* userData);
+void DLL_EXPORT unzipAsync(char* szipFilename, char* outputPath, SzipCallback callback, void* userData);
+SzipContext* DLL_EXPORT szipCreateContext(int codec, int level);
+void   DLL_EXPORT szipFreeContext(SzipContext* context);
+size_t DLL_EXPORT szipCompressBound(int codec, size_t len);
+int    DLL_EXPORT szipCompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen);
+int    DLL_EXPORT szipUncompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen);
+int    DLL_EXPORT szipUncompressedLength(SzipContext* context, const unsigned char* input, size_t len, size_t* outputLen);
 #ifdef __cplusplus
 }
 #endif
@@ -52,254 +74,1542 @@ extern "C" DLL_EXPORT BOOL APIENTRY DllMain(HINSTANCE hinstDLL, DWORD fdwReason,
 
 #else
 
-extern "C" void zip(char* sourceDirOrFileName, char* outputFilename);
-extern "C" void unzip(char* szipFilename, char* outputPath);
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef void (*SzipCallback)(int result, void* userData);
+typedef struct SzipContext SzipContext;
+extern "C" int  zip(char* sourceDirOrFileName, char* outputFilename);
+extern "C" int  unzip(char* szipFilename, char* outputPath);
+extern "C" void zipAsync(char* sourceDirOrFileName, char* outputFilename, SzipCallback callback, void* userData);
+extern "C" void unzipAsync(char* szipFilename, char* outputPath, SzipCallback callback, void* userData);
+extern "C" SzipContext* szipCreateContext(int codec, int level);
+extern "C" void   szipFreeContext(SzipContext* context);
+extern "C" size_t szipCompressBound(int codec, size_t len);
+extern "C" int    szipCompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen);
+extern "C" int    szipUncompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen);
+extern "C" int    szipUncompressedLength(SzipContext* context, const unsigned char* input, size_t len, size_t* outputLen);
 
 #endif
 
-void zip(char* sourceDirOrFileName, char* outputFilename)
+// The C entry points return zlib's codes: Z_OK (0), or Z_ERRNO, Z_STREAM_ERROR, Z_DATA_ERROR,
+// Z_MEM_ERROR and Z_BUF_ERROR (all negative). An exception is reported as Z_ERRNO.
+int zip(char* sourceDirOrFileName, char* outputFilename)
 {
     try
     {
-        Szip::zip(sourceDirOrFileName, outputFilename);
+        return Szip::zip(sourceDirOrFileName, outputFilename);
     }
     catch (...)
     {
+        return Z_ERRNO;
+    }
+}
+
+int unzip(char* szipFilename, char* outputPath)
+{
+    try
+    {
+        return Szip::unzip(szipFilename, outputPath);
+    }
+    catch (...)
+    {
+        return Z_ERRNO;
+    }
+}
+
+void zipAsync(char* sourceDirOrFileName, char* outputFilename, SzipCallback callback, void* userData)
+{
+    Szip::zipAsync(sourceDirOrFileName, outputFilename, [callback, userData](int result)
+    {
+        if (callback != NULL)  callback(result, userData);
+    });
+}
+
+void unzipAsync(char* szipFilename, char* outputPath, SzipCallback callback, void* userData)
+{
+    Szip::unzipAsync(szipFilename, outputPath, [callback, userData](int result)
+    {
+        if (callback != NULL)  callback(result, userData);
+    });
+}
+
+// In-memory compression for foreign callers: everything goes into buffers the caller owns, and
+// a context keeps the codec state between calls. A context may move between threads but must
+// not be used by two at once. *outputLen holds the output capacity on entry and the bytes
+// written on return; Z_BUF_ERROR means the output was too small.
+struct SzipContext
+{
+    CodecContext codec;
+
+    SzipContext(int codec, int level) : codec(codec, level) {}
+};
+
+SzipContext* szipCreateContext(int codec, int level)
+{
+    if (codec != SZIP_CODEC_ZLIB && codec != SZIP_CODEC_FAST)
+    {
+        return NULL;
+    }
+
+    return new (nothrow) SzipContext(codec, level);
+}
+
+void szipFreeContext(SzipContext* context)
+{
+    delete context;
+}
+
+size_t szipCompressBound(int codec, size_t len)
+{
+    return Codec::bound(codec, len);
+}
+
+int szipCompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen)
+{
+    if (context == NULL || outputLen == NULL || (input == NULL && len > 0) || output == NULL)
+    {
+        return Z_STREAM_ERROR;
+    }
+
+    return context->codec.compress(input, len, output, *outputLen);
+}
+
+int szipUncompress(SzipContext* context, const unsigned char* input, size_t len, unsigned char* output, size_t* outputLen)
+{
+    if (context == NULL || outputLen == NULL || input == NULL || (output == NULL && *outputLen > 0))
+    {
+        return Z_STREAM_ERROR;
+    }
+
+    return context->codec.uncompress(input, len, output, *outputLen);
+}
+
+// Tells the caller how large a buffer szipUncompress needs, at the cost of a decoding pass.
+int szipUncompressedLength(SzipContext* context, const unsigned char* input, size_t len, size_t* outputLen)
+{
+    if (context == NULL || outputLen == NULL || input == NULL)
+    {
+        return Z_STREAM_ERROR;
+    }
+
+    return context->codec.uncompressedLength(input, len, *outputLen);
+}
+
+int Szip::compressBytes(unsigned char* input, size_t len, vector<unsigned char>& output, int codec)
+{
+    // Compresses straight into the tail of output, then gives back what the bound overestimated.
+    size_t start = output.size();
+    size_t output_len = Codec::bound(codec, len);
+    output.resize(start + output_len);
+
+    int result = Codec::compress(codec, Z_DEFAULT_COMPRESSION, input, len, output.data() + start, output_len);
+    output.resize(start + ((result == Z_OK) ? output_len : 0));
+
+    return result;
+}
+
+int Szip::uncompressBytes(unsigned char* input, size_t len, vector<unsigned char>& output)
+{
+    if (len <= 0)
+    {
+        return 0;
+    }
+
+    size_t start = output.size();
+    size_t capacity = len * 10;
+    int result;
+
+    while (true)
+    {
+        output.resize(start + capacity);
+
+        size_t output_len = capacity;
+        result = Codec::uncompress(input, len, output.data() + start, output_len);
+        if (result != Z_BUF_ERROR)
+        {
+            output.resize(start + ((result == Z_OK) ? output_len : 0));
+            break;
+        }
+
+        capacity *= 10;
+    }
+
+    return result;
+}
+
+int Szip::zip(const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options)
+{
+    assert(fileExists(sourceDirOrFileName));
+    assert(outputFilename != "");
+
+    // Collected first, so an archive written inside the source tree doesn't include itself.
+    vector<Source> sources;
+    collect(sourceDirOrFileName, options.order, sources);
+
+    // Neither a single file nor stale volumes may be left to shadow the new archive.
+    remove(outputFilename.c_str());
+    removeVolumes(outputFilename);
+
+    if (options.volumeSize > 0)
+    {
+        VolumeWriter volumes(outputFilename, options.volumeSize);
+        ostream os(&volumes);
+
+        int result = zipSources(sources, os, options);
+        int closed = volumes.close();
+        if (result == Z_OK)
+        {
+            result = closed;
+        }
+
+        if (result != Z_OK)
+        {
+            removeVolumes(outputFilename);
+        }
+
+        return result;
+    }
+
+    ofstream os;
+    os.open(outputFilename, ios::out | ios::binary);
+    if (!os)
+    {
+        return Z_ERRNO;
+    }
+
+    int result = zipSources(sources, os, options);
+
+    os.close();
+    if (result != Z_OK)
+    {
+        remove(outputFilename.c_str());
+    }
+
+    return result;
+}
+
+int Szip::zip(const string& sourceDirOrFileName, ostream& os, const ZipOptions& options)
+{
+    assert(fileExists(sourceDirOrFileName));
+
+    vector<Source> sources;
+    collect(sourceDirOrFileName, options.order, sources);
+
+    return zipSources(sources, os, options);
+}
+
+int Szip::append(const string& szipFilename, const string& sourceDirOrFileName, const ZipOptions& options)
+{
+    assert(fileExists(sourceDirOrFileName));
+
+    // New frames would have to go into the last volume, past the size the others were cut at.
+    if (!fileExists(szipFilename) && fileExists(volumeName(szipFilename, 1)))
+    {
+        return Z_STREAM_ERROR;
+    }
+
+    fstream fs(szipFilename, ios::in | ios::out | ios::binary);
+    if (!fs)
+    {
+        return Z_ERRNO;
+    }
+
+    // A legacy archive is a single zlib stream, which can't take more data without a rewrite.
+    int magic = readMagic(fs);
+    if (magic != SZIP_MAGIC_INDEXED)
+    {
+        return (magic == 0) ? Z_DATA_ERROR : Z_STREAM_ERROR;
+    }
+
+    ArchiveIndex index;
+    int result = readIndex(fs, index);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    // The old index frame and trailer are all that gets overwritten; keep them to put back.
+    fs.seekg(0, ios::end);
+    uint64_t size = (uint64_t)fs.tellg();
+    vector<char> tail((size_t)(size - index.indexOffset));
+    fs.seekg(index.indexOffset);
+    fs.read(tail.data(), tail.size());
+    if (!fs)
+    {
+        return Z_ERRNO;
+    }
+
+    vector<Source> sources;
+    collect(sourceDirOrFileName, options.order, sources);
+
+    fs.seekp(index.indexOffset);
+
+    ArchiveWriter writer(fs, (options.blockSize > 0) ? options.blockSize : DEFAULT_BLOCK_SIZE, options.level, options.codec, options.threads);
+    result = writer.resume(index);
+
+    if (result == Z_OK)
+    {
+        result = putSources(sources, writer);
+    }
+
+    if (result == Z_OK)
+    {
+        result = writer.finish();
+    }
+
+    uint64_t end = (result == Z_OK) ? (uint64_t)fs.tellp() : size;
+    fs.close();
+
+    if (result != Z_OK)
+    {
+        // A fresh stream, since the failed one may still hold data it couldn't write.
+        fstream restore(szipFilename, ios::in | ios::out | ios::binary);
+        restore.seekp(index.indexOffset);
+        restore.write(tail.data(), tail.size());
+    }
+
+    // Needed after a failure, or should the new index have come out smaller than the old one.
+    if (fileLength(szipFilename) != end && resizeFile(szipFilename, (size_t)end) != 0 && result == Z_OK)
+    {
+        result = Z_ERRNO;
+    }
+
+    return result;
+}
+
+// Writes records out to outputPath as they stream past. Files get their mode and times
+// from the already-open descriptor when they are closed; symlinks and directory metadata
+// are applied in finish(), so no later entry is written through a link from the archive
+// and directory times aren't disturbed by their children being created.
+class Extractor : public RecordHandler
+{
+
+public:
+
+    explicit Extractor(const string& outputPath) : outputPath(outputPath), result(Z_OK), skipping(false)
+    {
+#ifndef _WIN32
+        fd = -1;
+        root = open(outputPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        parent = -1;
+#endif
+    }
+
+    ~Extractor()
+    {
+#ifndef _WIN32
+        if (fd >= 0)  close(fd);
+        if (parent >= 0)  close(parent);
+        if (root >= 0)  close(root);
+#endif
+    }
+
+    bool begin(const SzipEntry& entry)
+    {
+        if (!isSafeName(entry.name) || throughLink(entry.name))
+        {
+            result = Z_DATA_ERROR;
+            return false;
+        }
+
+        // Elsewhere everything is resolved relative to the output directory's descriptor.
+#ifdef _WIN32
+        string path = buildPath(outputPath, utf82ansi(entry.name));
+#else
+        const string& path = entry.name;
+#endif
+
+        current = entry;
+        skipping = (entry.type != PUT_FILE_T);
+        extent = 0;
+        extentDone = 0;
+
+        if (entry.type == PUT_DIR_T)
+        {
+            if (!makeDirectories(path))
+            {
+                result = Z_ERRNO;
+                return false;
+            }
+
+            if (entry.mode != 0)  deferred.push_back(make_pair(path, entry));
+        }
+        else if (entry.type == PUT_LINK_T)
+        {
+            deferred.push_back(make_pair(path, entry));
+            links.insert(entry.name);
+        }
+        else if (entry.type == PUT_HARDLINK_T)
+        {
+            // The target must be a file written earlier in this run; anything else already in
+            // the output directory is not the archive's to link to, and a later entry of this
+            // name would write through the link into it.
+            if (files.count(entry.target) == 0)
+            {
+                result = Z_DATA_ERROR;
+                return false;
+            }
+
+            if (!linkFile(path))
+            {
+                result = Z_ERRNO;
+                return false;
+            }
+        }
+        else if (entry.type == PUT_FILE_T)
+        {
+            if (unchanged(path))
+            {
+                skipping = true;
+            }
+            else if (!openFile(path))
+            {
+                result = Z_ERRNO;
+                return false;
+            }
+
+            files.insert(entry.name);
+        }
+
+        return true;
+    }
+
+    bool data(const unsigned char* data, size_t len)
+    {
+        if (skipping)
+        {
+            return true;
+        }
+
+        while (len > 0)
+        {
+            size_t n = len;
+            if (current.sparseLength != 0 && !seekExtent(n))
+            {
+                result = Z_ERRNO;
+                return false;
+            }
+
+#ifdef _WIN32
+            fout.write((const char*)data, n);
+#else
+            for (size_t done = 0; done < n; )
+            {
+                ssize_t w = write(fd, data + done, n - done);
+                if (w < 0)
+                {
+                    if (errno == EINTR)  continue;
+
+                    result = Z_ERRNO;
+                    return false;
+                }
+
+                done += w;
+            }
+#endif
+
+            data += n;
+            len -= n;
+        }
+
+        return true;
+    }
+
+    bool end()
+    {
+        if (skipping)
+        {
+            return true;
+        }
+
+#ifdef _WIN32
+        if (current.sparseLength != 0)
+        {
+            // No holes here; a trailing one still has to be there as zeros.
+            fout.seekp(0, ios::end);
+            if ((uint64_t)fout.tellp() < current.sparseLength)
+            {
+                fout.seekp(current.sparseLength - 1);
+                fout.put('\0');
+            }
+        }
+
+        fout.close();
+        if (fout.fail())
+        {
+            result = Z_ERRNO;
+            return false;
+        }
+#else
+        // Sets the length past the last extent; everything not written stays a hole.
+        if (current.sparseLength != 0 && ftruncate(fd, (off_t)current.sparseLength) != 0)
+        {
+            result = Z_ERRNO;
+        }
+
+        if (current.mode != 0)
+        {
+            struct timespec times[2];
+            setTimes(times, current);
+            if (fchmod(fd, current.mode & 07777) != 0 || futimens(fd, times) != 0)
+            {
+                result = Z_ERRNO;
+            }
+        }
+
+        if (close(fd) != 0)
+        {
+            result = Z_ERRNO;
+        }
+
+        fd = -1;
+        if (result != Z_OK)
+        {
+            return false;
+        }
+#endif
+
+        return true;
+    }
+
+    // Creates the symlinks and restores directory metadata, deepest directories first.
+    // Paths are resolved without following links, since by now the archive's own links exist.
+    int finish()
+    {
+#ifndef _WIN32
+        for (size_t i = 0; i < deferred.size() && result == Z_OK; i++)
+        {
+            const string& path = deferred[i].first;
+            const SzipEntry& entry = deferred[i].second;
+            if (entry.type != PUT_LINK_T)  continue;
+
+            const char* leaf;
+            int dir = openParent(path, leaf);
+            if (dir < 0)
+            {
+                result = Z_ERRNO;
+                break;
+            }
+
+            unlinkat(dir, leaf, 0);
+            if (symlinkat(entry.target.c_str(), dir, leaf) != 0)
+            {
+                result = Z_ERRNO;
+            }
+            else if (entry.mode != 0)
+            {
+                struct timespec times[2];
+                setTimes(times, entry);
+                utimensat(dir, leaf, times, AT_SYMLINK_NOFOLLOW);
+            }
+
+            if (dir != root)  close(dir);
+        }
+
+        vector<size_t> dirs;
+        for (size_t i = 0; i < deferred.size(); i++)
+        {
+            if (deferred[i].second.type == PUT_DIR_T)  dirs.push_back(i);
+        }
+
+        stable_sort(dirs.begin(), dirs.end(), DeeperFirst(deferred));
+
+        for (size_t i = 0; i < dirs.size() && result == Z_OK; i++)
+        {
+            const string& path = deferred[dirs[i]].first;
+            const SzipEntry& entry = deferred[dirs[i]].second;
+
+            const char* leaf;
+            int dir = openParent(path, leaf);
+            int self = (dir < 0) ? -1 : openat(dir, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (dir >= 0 && dir != root)  close(dir);
+
+            struct timespec times[2];
+            setTimes(times, entry);
+            if (self < 0 || fchmod(self, entry.mode & 07777) != 0 || futimens(self, times) != 0)
+            {
+                result = Z_ERRNO;
+            }
+
+            if (self >= 0)  close(self);
+        }
+#endif
+
+        return result;
+    }
+
+    int error() const
+    {
+        return result;
+    }
+
+    // Enables skipping files that match these entries; see UnzipOptions::skipUnchanged.
+    void compareWith(const vector<SzipEntry>& entries)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].type == PUT_FILE_T)  crcs[entries[i].offset] = entries[i].crc;
+        }
+    }
+
+private:
+
+    typedef vector<pair<string, SzipEntry>> Deferred;
+
+    struct DeeperFirst
+    {
+        explicit DeeperFirst(const Deferred& deferred) : deferred(deferred) {}
+
+        bool operator()(size_t a, size_t b) const
+        {
+            return depth(deferred[a].first) > depth(deferred[b].first);
+        }
+
+        static size_t depth(const string& path)
+        {
+            return count(path.begin(), path.end(), '/');
+        }
+
+        const Deferred& deferred;
+    };
+
+#ifdef _WIN32
+    bool makeDirectories(const string& path)
+    {
+        return fileExists(path) || createDirectories(path) == 0;
+    }
+
+    bool openFile(const string& path)
+    {
+        // Replace rather than truncate, so a hard link at this name leaves its other names alone.
+        DeleteFileA(path.c_str());
+
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            fout.clear();
+            fout.open(path, ios::binary | ios::trunc);
+            if (fout.is_open())
+            {
+                return true;
+            }
+
+            if (createDirectories(dirName(path)) != 0)
+            {
+                break;
+            }
+        }
+
+        return false;
+    }
+
+    bool linkFile(const string& path)
+    {
+        string target = buildPath(outputPath, utf82ansi(current.target));
+        DeleteFileA(path.c_str());
+
+        return CreateHardLinkA(path.c_str(), target.c_str(), NULL) != 0;
+    }
+#else
+    // Creates name and any missing ancestors below the output directory. Directories made or
+    // found once are remembered, so an entry normally costs one mkdirat at most.
+    bool makeDirectories(const string& name)
+    {
+        if (created.count(name) != 0)
+        {
+            return true;
+        }
+
+        int at = root;
+        const char* leaf = name.c_str();
+
+        size_t slash = name.rfind('/');
+        if (slash != string::npos)
+        {
+            string up = name.substr(0, slash);
+            if (!makeDirectories(up))
+            {
+                return false;
+            }
+
+            if (parent >= 0 && up == parentName)
+            {
+                at = parent;
+                leaf += slash + 1;
+            }
+        }
 
+        if (mkdirat(at, leaf, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+
+        created.insert(name);
+        return true;
+    }
+
+    // Returns a descriptor for the directory holding the next files. Only the last one is
+    // kept open: archives store a directory's files together, so it rarely changes.
+    int directory(const string& name)
+    {
+        if (parent >= 0 && name == parentName)
+        {
+            return parent;
+        }
+
+        if (!makeDirectories(name))
+        {
+            return -1;
+        }
+
+        int dir = openat(root, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir < 0)
+        {
+            return -1;
+        }
+
+        if (parent >= 0)  close(parent);
+        parent = dir;
+        parentName = name;
+
+        return dir;
+    }
+
+    // Returns the descriptor of name's directory, and its last component in leaf.
+    int locate(const string& name, const char*& leaf)
+    {
+        size_t slash = name.rfind('/');
+        leaf = name.c_str() + ((slash == string::npos) ? 0 : slash + 1);
+
+        return (slash == string::npos) ? root : directory(name.substr(0, slash));
+    }
+
+    bool openFile(const string& name)
+    {
+        const char* leaf;
+        int dir = locate(name, leaf);
+        if (dir < 0)
+        {
+            return false;
+        }
+
+        // Owner-only until end() applies the recorded mode. Whatever is at this name already,
+        // a symlink or a file with other hard links, is replaced rather than written through.
+        mode_t mode = (current.mode != 0) ? S_IRUSR | S_IWUSR : 0666;
+        int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+
+        fd = openat(dir, leaf, flags, mode);
+        if (fd < 0 && errno == EEXIST && unlinkat(dir, leaf, 0) == 0)
+        {
+            fd = openat(dir, leaf, flags, mode);
+        }
+
+        return fd >= 0;
+    }
+
+    // Like locate(), but opens every directory on the way with O_NOFOLLOW. The caller closes
+    // the result unless it is root.
+    int openParent(const string& name, const char*& leaf)
+    {
+        size_t slash = name.rfind('/');
+        leaf = name.c_str() + ((slash == string::npos) ? 0 : slash + 1);
+
+        int at = root;
+        for (size_t start = 0; slash != string::npos && start < slash; )
+        {
+            size_t end = min(name.find('/', start), slash);
+            if (end > start)
+            {
+                int next = openat(at, name.substr(start, end - start).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (at != root)  close(at);
+                if (next < 0)
+                {
+                    return -1;
+                }
+
+                at = next;
+            }
+
+            start = end + 1;
+        }
+
+        return at;
+    }
+
+    bool linkFile(const string& name)
+    {
+        const char* leaf;
+        int dir = locate(name, leaf);
+        if (dir < 0)
+        {
+            return false;
+        }
+
+        if (linkat(root, current.target.c_str(), dir, leaf, 0) == 0)
+        {
+            return true;
+        }
+
+        return errno == EEXIST && unlinkat(dir, leaf, 0) == 0 && linkat(root, current.target.c_str(), dir, leaf, 0) == 0;
+    }
+#endif
+
+    // Positions the output where the next data bytes of a sparse file belong, and cuts n
+    // down to what is left of the extent there.
+    bool seekExtent(size_t& n)
+    {
+        const vector<SzipExtent>& extents = current.extents;
+        while (extent < extents.size() && extentDone == extents[extent].length)
+        {
+            extent++;
+            extentDone = 0;
+        }
+
+        if (extent == extents.size())
+        {
+            return false;
+        }
+
+        if (extentDone == 0)
+        {
+#ifdef _WIN32
+            fout.seekp(extents[extent].offset);
+#else
+            if (lseek(fd, (off_t)extents[extent].offset, SEEK_SET) < 0)
+            {
+                return false;
+            }
+#endif
+        }
+
+        n = (size_t)min<uint64_t>(n, extents[extent].length - extentDone);
+        extentDone += n;
+
+        return true;
+    }
+
+    // Decides whether the current file can stay as it is: same size, and the same mtime or
+    // failing that the same content. The file is only read in the second case.
+    bool unchanged(const string& name)
+    {
+#ifdef _WIN32
+        return false;
+#else
+        unordered_map<uint64_t, uint32_t>::const_iterator it = crcs.find(current.offset);
+        if (it == crcs.end())
+        {
+            return false;
+        }
+
+        const char* leaf;
+        int dir = locate(name, leaf);
+        uint64_t length = (current.sparseLength != 0) ? current.sparseLength : current.size;
+
+        struct stat st;
+        if (dir < 0 || fstatat(dir, leaf, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != length)
+        {
+            return false;
+        }
+
+#ifdef __APPLE__
+        const struct timespec& mtime = st.st_mtimespec;
+#else
+        const struct timespec& mtime = st.st_mtim;
+#endif
+        bool sameTime = current.mode != 0 && mtime.tv_sec == (time_t)current.mtime && (uint32_t)mtime.tv_nsec == current.mtimeNsec;
+
+        // A sparse file's CRC only covers its extents, so it can't be checked against the whole file.
+        if (!sameTime && (current.sparseLength != 0 || !sameContent(dir, leaf, it->second)))
+        {
+            return false;
+        }
+
+        if (current.mode != 0)
+        {
+            struct timespec times[2];
+            setTimes(times, current);
+            if (((st.st_mode & 07777) != (current.mode & 07777) && fchmodat(dir, leaf, current.mode & 07777, 0) != 0) ||
+                (!sameTime && utimensat(dir, leaf, times, AT_SYMLINK_NOFOLLOW) != 0))
+            {
+                return false;
+            }
+        }
+
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    static bool sameContent(int dir, const char* leaf, uint32_t crc)
+    {
+        int in = openat(dir, leaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0)
+        {
+            return false;
+        }
+
+        BufferPool& pool = BufferPool::shared();
+        size_t capacity = DEFAULT_BLOCK_SIZE;
+        unsigned char* buffer = pool.acquire(capacity);
+
+        uint32_t actual = 0;
+        ssize_t n;
+        while ((n = read(in, buffer, capacity)) != 0)
+        {
+            if (n < 0 && errno == EINTR)  continue;
+            if (n < 0)  break;
+
+            actual = Codec::crc32(actual, buffer, (size_t)n);
+        }
+
+        pool.release(buffer, capacity);
+        close(in);
+
+        return n == 0 && actual == crc;
+    }
+
+    static void setTimes(struct timespec* times, const SzipEntry& entry)
+    {
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = (time_t)entry.mtime;
+        times[1].tv_nsec = entry.mtimeNsec;
+    }
+#endif
+
+    // Whether one of name's parent directories is a symlink entry seen earlier in the archive;
+    // writing below it would go wherever the link points once it has been made.
+    bool throughLink(const string& name) const
+    {
+        if (links.empty())
+        {
+            return false;
+        }
+
+        for (size_t slash = name.find_first_of("/\\"); slash != string::npos; slash = name.find_first_of("/\\", slash + 1))
+        {
+            if (links.count(name.substr(0, slash)) != 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Rejects names that would land outside outputPath.
+    static bool isSafeName(const string& name)
+    {
+        if (name.empty() || name[0] == '/' || name[0] == '\\')
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        if (name.find(':') != string::npos)
+        {
+            return false;
+        }
+#endif
+
+        size_t start = 0;
+        while (start <= name.length())
+        {
+            size_t end = name.find_first_of("/\\", start);
+            if (end == string::npos)
+            {
+                end = name.length();
+            }
+
+            if (name.compare(start, end - start, "..") == 0)
+            {
+                return false;
+            }
+
+            start = end + 1;
+        }
+
+        return true;
+    }
+
+    string    outputPath;
+    SzipEntry current;
+    Deferred  deferred;
+    unordered_set<string> links;    // names of the symlink entries so far
+    unordered_set<string> files;    // names of the file entries written or kept so far
+#ifdef _WIN32
+    ofstream  fout;
+#else
+    int       fd;
+    int       root;
+    int       parent;
+    string    parentName;
+    unordered_set<string> created;
+#endif
+    unordered_map<uint64_t, uint32_t> crcs;     // data offset to CRC-32, for skipUnchanged
+    size_t    extent;       // where a sparse file's data has got to
+    uint64_t  extentDone;
+    int       result;
+    bool      skipping;
+};
+
+// Collects entries and discards their data.
+class Lister : public RecordHandler
+{
+
+public:
+
+    Lister(vector<SzipEntry>& entries, const string& wanted = "") : entries(entries), wanted(wanted)
+    {
+
+    }
+
+    bool begin(const SzipEntry& entry)
+    {
+        if (wanted.empty() || entry.name == wanted)
+        {
+            entries.push_back(entry);
+        }
+
+        // A later record of the same name overwrites this one on extraction, so keep looking.
+        return true;
+    }
+
+    bool data(const unsigned char* data, size_t len)
+    {
+        return true;
+    }
+
+    bool end()
+    {
+        return true;
+    }
+
+private:
+
+    vector<SzipEntry>& entries;
+    string             wanted;
+};
+
+// Checks file data against what the index records for it, matched up by data offset.
+class Verifier : public RecordHandler
+{
+
+public:
+
+    Verifier() : files(0), offset(0), crc(0), isFile(false)
+    {
+
+    }
+
+    bool begin(const SzipEntry& entry)
+    {
+        offset = entry.offset;
+        crc = 0;
+        isFile = (entry.type == PUT_FILE_T);
+
+        return true;
+    }
+
+    bool data(const unsigned char* data, size_t len)
+    {
+        crc = Codec::crc32(crc, data, len);
+        return true;
+    }
+
+    bool end()
+    {
+        if (isFile)
+        {
+            crcs[offset] = crc;
+            files++;
+        }
+
+        return true;
+    }
+
+    int check(const ArchiveIndex& index) const
+    {
+        size_t indexed = 0;
+        for (size_t i = 0; i < index.entries.size(); i++)
+        {
+            const SzipEntry& entry = index.entries[i];
+            if (entry.type != PUT_FILE_T)
+            {
+                continue;
+            }
+
+            unordered_map<uint64_t, uint32_t>::const_iterator it = crcs.find(entry.offset);
+            if (it == crcs.end() || it->second != entry.crc)
+            {
+                return Z_DATA_ERROR;
+            }
+
+            indexed++;
+        }
+
+        return (indexed == files) ? Z_OK : Z_DATA_ERROR;
+    }
+
+private:
+
+    unordered_map<uint64_t, uint32_t> crcs;
+    size_t   files;
+    uint64_t offset;
+    uint32_t crc;
+    bool     isFile;
+};
+
+// An archive on disk: the file of that name, or when there is none, its volumes.
+class ArchiveFile
+{
+
+public:
+
+    explicit ArchiveFile(const string& name) : joined(NULL), split(false)
+    {
+        if (!fileExists(name) && volumes.open(name))
+        {
+            reader.reset(new VolumeReader(volumes));
+            joined.rdbuf(reader.get());
+            split = true;
+        }
+        else
+        {
+            file.open(name, ios::binary);
+        }
+    }
+
+    bool isOpen() const
+    {
+        return split || file.is_open();
+    }
+
+    istream& stream()
+    {
+        return split ? joined : file;
+    }
+
+    // Only volumes are worth reading from several threads; a single file is read ahead anyway.
+    FrameSource* source()
+    {
+        return split ? &volumes : NULL;
+    }
+
+private:
+
+    ifstream                  file;
+    VolumeSet                 volumes;
+    unique_ptr<VolumeReader>  reader;
+    istream                   joined;
+    bool                      split;
+};
+
+int Szip::unzip(const string& szipFilename, const string& outputPath, const UnzipOptions& options)
+{
+    assert(fileExists(szipFilename) || fileExists(volumeName(szipFilename, 1)));
+
+    ArchiveFile archive(szipFilename);
+    if (!archive.isOpen())
+    {
+        return Z_ERRNO;
     }
+
+    return extract(archive.stream(), archive.source(), outputPath, options);
+}
+
+int Szip::unzip(istream& is, const string& outputPath, const UnzipOptions& options)
+{
+    return extract(is, NULL, outputPath, options);
+}
+
+int Szip::list(const string& szipFilename, vector<SzipEntry>& entries)
+{
+    ArchiveFile archive(szipFilename);
+    if (!archive.isOpen())
+    {
+        return Z_ERRNO;
+    }
+
+    return list(archive.stream(), entries);
+}
+
+int Szip::list(istream& is, vector<SzipEntry>& entries)
+{
+    int magic = readMagic(is);
+    if (magic == 0)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    // Without seeking, an indexed archive is listed the way a legacy one is.
+    if (magic == SZIP_MAGIC_INDEXED && is.tellg() >= 0)
+    {
+        ArchiveIndex index;
+        int result = readIndex(is, index);
+        if (result == Z_OK)
+        {
+            entries.insert(entries.end(), index.entries.begin(), index.entries.end());
+        }
+
+        return result;
+    }
+
+    Lister lister(entries);
+    return walkRecords(is, magic, lister);
+}
+
+int Szip::test(const string& szipFilename, size_t threads)
+{
+    ArchiveFile archive(szipFilename);
+    if (!archive.isOpen())
+    {
+        return Z_ERRNO;
+    }
+
+    return verify(archive.stream(), archive.source(), threads);
+}
+
+int Szip::test(istream& is, size_t threads)
+{
+    return verify(is, NULL, threads);
 }
 
-void unzip(char* szipFilename, char* outputPath)
+int Szip::stat(const string& szipFilename, const string& name, SzipEntry& entry)
 {
-    try
+    ArchiveFile archive(szipFilename);
+    istream& is = archive.stream();
+    int magic = readMagic(is);
+    if (magic == 0)
     {
-        Szip::unzip(szipFilename, outputPath);
+        return archive.isOpen() ? Z_DATA_ERROR : Z_ERRNO;
     }
-    catch (...)
-    {
 
-    }
-}
+    vector<SzipEntry> found;
+    int result;
 
-int Szip::compressBytes(unsigned char* input, size_t len, vector<unsigned char>& output)
-{
-    unsigned long output_len = compressBound((unsigned long)len);
-    unsigned char* buffer = new unsigned char[output_len];
+    if (magic == SZIP_MAGIC_INDEXED)
+    {
+        ArchiveIndex index;
+        result = readIndex(is, index);
+        for (size_t i = 0; result == Z_OK && i < index.entries.size(); i++)
+        {
+            if (index.entries[i].name == name)  found.push_back(index.entries[i]);
+        }
+    }
+    else
+    {
+        Lister lister(found, name);
+        result = walkRecords(is, magic, lister);
+    }
 
-    int result = compress(buffer, &output_len, input, (unsigned long)len);
     if (result != Z_OK)
     {
-        delete[] buffer;
-
         return result;
     }
 
-    output.reserve(output_len);
-    output.insert(output.end(), buffer, buffer + output_len);
-    delete[] buffer;
+    if (found.empty())
+    {
+        return Z_STREAM_END;
+    }
 
+    entry = found.back();
     return Z_OK;
 }
 
-int Szip::uncompressBytes(unsigned char* input, size_t len, vector<unsigned char>& output)
-{
-    if (len <= 0)
-    {
-        return 0;
-    }
+static mutex    executorLock;
+static Executor defaultExecutor;
 
-    unsigned long output_len = (unsigned long)len * 10;
-    unsigned char* buffer = new unsigned char[output_len];
+future<int> Szip::zipAsync(const string& sourceDirOrFileName, const string& outputFilename, const Executor& executor)
+{
+    return zipAsync(sourceDirOrFileName, outputFilename, ZipOptions(), executor);
+}
 
-    int result = uncompress(buffer, &output_len, input, (unsigned long)len);
+future<int> Szip::unzipAsync(const string& szipFilename, const string& outputPath, const Executor& executor)
+{
+    return unzipAsync(szipFilename, outputPath, UnzipOptions(), executor);
+}
 
-    if (result == Z_DATA_ERROR)
-    {
-        delete[] buffer;
+void Szip::zipAsync(const string& sourceDirOrFileName, const string& outputFilename, const function<void(int)>& callback, const Executor& executor)
+{
+    zipAsync(sourceDirOrFileName, outputFilename, ZipOptions(), callback, executor);
+}
 
-        return result;
-    }
+void Szip::unzipAsync(const string& szipFilename, const string& outputPath, const function<void(int)>& callback, const Executor& executor)
+{
+    unzipAsync(szipFilename, outputPath, UnzipOptions(), callback, executor);
+}
 
-    while (result == Z_BUF_ERROR)
-    {
-        output_len *= 10;
-        delete[] buffer;
-        buffer = new unsigned char[output_len];
+// The options are copied into the job; the caller's may be gone by the time it runs.
+future<int> Szip::zipAsync(const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options, const Executor& executor)
+{
+    return submit([sourceDirOrFileName, outputFilename, options]() { return zip(sourceDirOrFileName, outputFilename, options); }, executor);
+}
 
-        result = uncompress(buffer, &output_len, input, (unsigned long)len);
-    }
+future<int> Szip::unzipAsync(const string& szipFilename, const string& outputPath, const UnzipOptions& options, const Executor& executor)
+{
+    return submit([szipFilename, outputPath, options]() { return unzip(szipFilename, outputPath, options); }, executor);
+}
 
-    if (result != Z_OK)
-    {
-        delete[] buffer;
+void Szip::zipAsync(const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options, const function<void(int)>& callback, const Executor& executor)
+{
+    submit([sourceDirOrFileName, outputFilename, options]() { return zip(sourceDirOrFileName, outputFilename, options); }, callback, executor);
+}
 
-        return result;
-    }
+void Szip::unzipAsync(const string& szipFilename, const string& outputPath, const UnzipOptions& options, const function<void(int)>& callback, const Executor& executor)
+{
+    submit([szipFilename, outputPath, options]() { return unzip(szipFilename, outputPath, options); }, callback, executor);
+}
 
-    output.reserve(output_len);
-    output.insert(output.end(), buffer, buffer + output_len);
-    delete[] buffer;
+void Szip::setExecutor(const Executor& executor)
+{
+    lock_guard<mutex> guard(executorLock);
+    defaultExecutor = executor;
+}
 
-    return Z_OK;
+size_t Szip::estimateZipMemory(const string& sourceDirOrFileName, size_t& inputSize)
+{
+    return estimateZipMemory(sourceDirOrFileName, ZipOptions(), inputSize);
 }
 
-int Szip::zip(const string& sourceDirOrFileName, const string& outputFilename)
+size_t Szip::estimateUnzipMemory(const string& szipFilename, size_t& inputSize)
 {
-    assert(fileExists(sourceDirOrFileName));
-    assert(outputFilename != "");
+    return estimateUnzipMemory(szipFilename, UnzipOptions(), inputSize);
+}
 
-    size_t srcSize = 0, pos = 0;
+size_t Szip::estimateZipMemory(const string& sourceDirOrFileName, const ZipOptions& options, size_t& inputSize)
+{
+    inputSize = 0;
     if (isFile(sourceDirOrFileName))
     {
-        srcSize = fileLength(sourceDirOrFileName);
+        inputSize = fileLength(sourceDirOrFileName);
     }
     else
     {
-        getFolderSize(sourceDirOrFileName, "", srcSize);
+        getFolderSize(sourceDirOrFileName, "", inputSize);
     }
 
-    srcSize = (size_t)((srcSize + 1024) * 1.2);
-    unsigned char* buffer = new unsigned char[srcSize];
-    unsigned char const magic[] = { 12, 29 };
+    // A block and its compressed copy for each block compressing on the pool, plus the one
+    // being filled meanwhile; the index is small next to that.
+    size_t blockSize = (options.blockSize > 0) ? options.blockSize : DEFAULT_BLOCK_SIZE;
+    size_t blocks = (options.threads > 1) ? options.threads + 1 : 1;
 
-    if (isFile(sourceDirOrFileName))
+    return blocks * (blockSize + compressBound((uLong)blockSize));
+}
+
+size_t Szip::estimateUnzipMemory(const string& szipFilename, const UnzipOptions& options, size_t& inputSize)
+{
+    VolumeSet volumes;
+    bool split = !fileExists(szipFilename) && volumes.open(szipFilename);
+    inputSize = split ? (size_t)volumes.size() : fileLength(szipFilename);
+
+    // The archive's block size is that of its first frame. Each decoding thread holds a block
+    // and its compressed copy; legacy archives are streamed in much smaller chunks.
+    size_t blockSize = DEFAULT_BLOCK_SIZE;
+    ifstream is(split ? volumeName(szipFilename, 1) : szipFilename, ios::binary);
+
+    unsigned char kind, method;
+    uint32_t rawLength, packedLength;
+    if (readMagic(is) == SZIP_MAGIC_INDEXED && readFrameHeader(is, kind, method, rawLength, packedLength) == Z_OK && kind == FRAME_BLOCK)
     {
-        put(PUT_FILE_T, sourceDirOrFileName, buffer, pos);
+        blockSize = rawLength;
     }
-    else
+
+    return max<size_t>(options.threads, 1) * (blockSize + compressBound((uLong)blockSize));
+}
+
+// private:
+
+int Szip::extract(istream& is, FrameSource* source, const string& outputPath, const UnzipOptions& options)
+{
+    int magic = readMagic(is);
+    if (magic == 0)
     {
-        readFile(sourceDirOrFileName, "", buffer, pos);
+        return Z_DATA_ERROR;
     }
 
-    unsigned long output_len = compressBound((unsigned long)pos);
-    unsigned char* compressed = new unsigned char[output_len];
+    if (!fileExists(outputPath))
+    {
+        createDirectories(outputPath);
+    }
 
-    int result = compress(compressed, &output_len, buffer, (unsigned long)pos);
-    if (result != Z_OK)
+    Extractor extractor(outputPath);
+    if (options.skipUnchanged && magic == SZIP_MAGIC_INDEXED && is.tellg() >= 0)
     {
-        delete[] buffer;
-        delete[] compressed;
+        // The CRCs live in the index only; a damaged one surfaces in the walk below.
+        ArchiveIndex index;
+        if (readIndex(is, index) == Z_OK)
+        {
+            extractor.compareWith(index.entries);
+        }
 
-        return result;
+        is.clear();
+        is.seekg(2);
     }
 
-    delete[] buffer;
+    int result = walkRecords(is, magic, extractor, options.threads, NULL, source);
+    if (result == Z_STREAM_END)
+    {
+        return extractor.error();
+    }
 
-    remove(outputFilename.c_str());
-    ofstream os;
-    os.open(outputFilename, ios::out | ios::binary | ios::app);
-    os.write((char*)magic, 2);
-    os.write((char*)compressed, output_len);
-    os.close();
-    delete[] compressed;
+    return (result == Z_OK) ? extractor.finish() : result;
+}
 
-    return Z_OK;
+int Szip::verify(istream& is, FrameSource* source, size_t threads)
+{
+    int magic = readMagic(is);
+    if (magic == 0)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    Verifier verifier;
+    if (magic == SZIP_MAGIC_LEGACY)
+    {
+        return walkRecords(is, magic, verifier);
+    }
+
+    ArchiveIndex index;
+    int result = walkRecords(is, magic, verifier, threads, &index, source);
+    if (result != Z_OK)
+    {
+        return result;
+    }
+
+    // The trailer must point back at the index just read, and end the archive.
+    unsigned char trailer[TRAILER_SIZE];
+    is.read((char*)trailer, TRAILER_SIZE);
+    if (is.gcount() != TRAILER_SIZE || szip::Bytes::peek<uint64_t>(trailer, 0) != index.indexOffset ||
+        trailer[8] != SZIP_MAGIC || trailer[9] != SZIP_MAGIC_INDEXED || is.peek() != char_traits<char>::eof())
+    {
+        return Z_DATA_ERROR;
+    }
+
+    return verifier.check(index);
 }
 
+future<int> Szip::submit(const function<int()>& job, const Executor& executor)
+{
+    // packaged_task is move-only, std::function needs a copyable target.
+    shared_ptr<packaged_task<int()>> task = make_shared<packaged_task<int()>>(job);
+    future<int> result = task->get_future();
+
+    dispatch([task]() { (*task)(); }, executor);
+
+    return result;
+}
 
-int Szip::unzip(const string& szipFilename, const string& outputPath)
+void Szip::submit(const function<int()>& job, const function<void(int)>& callback, const Executor& executor)
 {
-    assert(fileExists(szipFilename));
-    size_t len = fileLength(szipFilename);
-    assert(len > 2);
+    dispatch([job, callback]()
+    {
+        int result;
 
-    unsigned char const magic[] = { 12, 29 };
-    unsigned char* data = new unsigned char[len];
-    ifstream fin(szipFilename, ios::binary);
-    fin.read((char *)data, len);
+        try
+        {
+            result = job();
+        }
+        catch (...)
+        {
+            result = Z_ERRNO;
+        }
 
-    assert(data[0] == magic[0] && data[1] == magic[1]);
+        if (callback)  callback(result);
+    }, executor);
+}
 
-    unsigned long output_len = (unsigned long)len * 10;
-    unsigned char* buffer = new unsigned char[output_len];
-    int result = uncompress(buffer, &output_len, data + 2, (unsigned long)len - 2);
+void Szip::dispatch(const function<void()>& task, const Executor& executor)
+{
+    if (executor)
+    {
+        executor(task);
+        return;
+    }
 
-    if (result == Z_DATA_ERROR)
+    Executor current;
     {
-        delete[] data;
-        delete[] buffer;
+        lock_guard<mutex> guard(executorLock);
+        current = defaultExecutor;
+    }
 
-        return result;
+    if (current)
+    {
+        current(task);
     }
+    else
+    {
+        ThreadPool::shared().post(task);
+    }
+}
 
-    while (result == Z_BUF_ERROR)
+void Szip::collect(const string& sourceDirOrFileName, int order, vector<Source>& sources)
+{
+    if (isFile(sourceDirOrFileName))
+    {
+        Source source = { PUT_FILE_T, baseName(sourceDirOrFileName), sourceDirOrFileName, "" };
+        sources.push_back(source);
+    }
+    else
     {
-        output_len *= 10;
-        delete[] buffer;
-        buffer = new unsigned char[output_len];
+        readFile(sourceDirOrFileName, "", sources);
+    }
 
-        result = uncompress(buffer, &output_len, data + 2, (unsigned long)len - 2);
+    if (order != SZIP_ORDER_NATURAL)
+    {
+        group(sources, order);
     }
+}
 
-    delete[] data;
+int Szip::zipSources(const vector<Source>& sources, ostream& os, const ZipOptions& options)
+{
+    ArchiveWriter writer(os, (options.blockSize > 0) ? options.blockSize : DEFAULT_BLOCK_SIZE, options.level, options.codec, options.threads);
+    int result = writer.start();
 
-    if (result != Z_OK)
+    if (result == Z_OK)
     {
-        delete[] buffer;
-
-        return result;
+        result = putSources(sources, writer);
     }
 
-    if (!fileExists(outputPath))
+    if (result == Z_OK)
     {
-        createDirectories(outputPath);
+        result = writer.finish();
     }
 
-    string dir = outputPath;
-    size_t pos = 0;
-    while (pos < output_len)
-    {
-        unsigned char type = buffer[pos++];
-        unsigned short len = szip::Bytes::peek<unsigned short>(buffer, pos);
-        pos += 2;
-#ifdef _WIN32
-        string name = utf82ansi(string((char*)buffer + pos, len));
-#else
-        string name((char*)buffer + pos, len);
-#endif
+    return result;
+}
 
-        pos += len;
+int Szip::putSources(const vector<Source>& sources, ArchiveWriter& writer)
+{
+    int result = Z_OK;
+    Inodes inodes;
 
-        if (type == 0x01)
+    for (size_t i = 0; i < sources.size() && result == Z_OK; i++)
+    {
+        if (i > 0 && sources[i].group != sources[i - 1].group)
         {
-            dir = buildPath(outputPath, name);
-            if (!fileExists(dir))  createDirectories(dir);
+            result = writer.endGroup();
         }
-        else
-        {
-            string filename = buildPath(dir, name);
-            size_t file_len = szip::Bytes::peek<unsigned int>(buffer, pos);
-            pos += 4;
 
-            ofstream fout;
-            fout.open(filename, ios::binary);
-            for (size_t i = 0; i < file_len; i++)
-            {
-                fout << buffer[i + pos];
-            }
-            fout << flush;
-            fout.close();
-            pos += file_len;
+        if (result == Z_OK)
+        {
+            result = put(sources[i].type, sources[i].name, sources[i].path, writer, inodes);
         }
     }
 
-    delete[] buffer;
-    return Z_OK;
+    return result;
 }
 
-// private:
-
 void Szip::getFolderSize(const string& dir, const string& rootDir, size_t& size)
 {
-    vector<string> files;
-    getFiles(dir, files);
+    vector<string> files, dirs;
+    getEntries(dir, files, dirs);
     for (size_t i = 0; i < files.size(); i++)
     {
         size += fileLength(files[i]);
     }
 
-    vector<string> dirs;
-    getDirs(dir, dirs);
     for (size_t i = 0; i < dirs.size(); i++)
     {
         string t = buildPath(rootDir, baseName(dirs[i]));
@@ -307,51 +1617,282 @@ void Szip::getFolderSize(const string& dir, const string& rootDir, size_t& size)
     }
 }
 
-void Szip::readFile(const string& dir, const string& rootDir, unsigned char* buffer, size_t& pos)
+void Szip::readFile(const string& dir, const string& rootDir, vector<Source>& sources)
 {
-    vector<string> files;
-    getFiles(dir, files);
+    vector<string> files, dirs;
+    getEntries(dir, files, dirs);
     for (size_t i = 0; i < files.size(); i++)
     {
-        put(PUT_FILE_T, files[i], buffer, pos);
+        Source source = { PUT_FILE_T, buildPath(rootDir, baseName(files[i])), files[i], "" };
+        sources.push_back(source);
     }
 
-    vector<string> dirs;
-    getDirs(dir, dirs);
     for (size_t i = 0; i < dirs.size(); i++)
     {
         string t = buildPath(rootDir, baseName(dirs[i]));
-        put(PUT_DIR_T, t, buffer, pos);
-        readFile(dirs[i], t, buffer, pos);
+        Source source = { PUT_DIR_T, t, dirs[i], "" };
+        sources.push_back(source);
+        readFile(dirs[i], t, sources);
+    }
+}
+
+// Puts files of the same kind next to each other, so that similar content shares a deflate
+// window and a block. Directories keep their relative order and go first, which also means
+// every file's directory exists before the file is extracted.
+void Szip::group(vector<Source>& sources, int order)
+{
+    vector<Source> files;
+    size_t dirs = 0;
+
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        if (sources[i].type == PUT_DIR_T)
+        {
+            sources[dirs++] = sources[i];
+        }
+        else
+        {
+            files.push_back(sources[i]);
+        }
+    }
+
+    sources.resize(dirs);
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        Source& file = files[i];
+        string name = baseName(file.path);
+        size_t dot = name.rfind('.');
+
+        string extension = (dot != string::npos && dot > 0) ? name.substr(dot + 1) : "";
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        // Size classes are powers of four: tiny configs don't mix with large assets of the same type.
+        size_t length = fileLength(file.path), size = length, sizeClass = 0;
+        while (size >= 1024 && sizeClass < 15)
+        {
+            size >>= 2;
+            sizeClass++;
+        }
+
+        file.group = extension + '\0' + (char)('a' + sizeClass);
+
+        if (order == SZIP_ORDER_CONTENT && length > 0 && length != (size_t)-1)
+        {
+            // Leading bytes identify most binary formats (ELF, PNG, gzip, ...) regardless of name.
+            char head[8] = { 0 };
+            ifstream is(file.path, ios::binary);
+            is.read(head, sizeof(head));
+            file.group.append(head, (size_t)is.gcount());
+        }
+    }
+
+    stable_sort(files.begin(), files.end(), [](const Source& a, const Source& b)
+    {
+        return (a.group != b.group) ? a.group < b.group : a.name < b.name;
+    });
+    sources.insert(sources.end(), files.begin(), files.end());
+}
+
+#if !defined(_WIN32) && defined(SEEK_DATA)
+// Lists the data regions of a file with holes. Past SPARSE_EXTENTS_MAX, the regions around
+// the shortest holes are joined and those holes stored as zeros.
+static void findExtents(const string& path, uint64_t size, vector<SzipExtent>& extents)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    off_t position = 0;
+    while ((uint64_t)position < size)
+    {
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data < 0)
+        {
+            // ENXIO: nothing but hole up to the end. Anything else: no hole support after all.
+            if (errno != ENXIO)  extents.assign(1, SzipExtent{ 0, size });
+            break;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > size)
+        {
+            hole = (off_t)size;
+        }
+
+        extents.push_back(SzipExtent{ (uint64_t)data, (uint64_t)(hole - data) });
+        position = hole;
+    }
+
+    close(fd);
+
+    if (extents.size() > SPARSE_EXTENTS_MAX)
+    {
+        vector<uint64_t> gaps;
+        for (size_t i = 1; i < extents.size(); i++)
+        {
+            gaps.push_back(extents[i].offset - extents[i - 1].offset - extents[i - 1].length);
+        }
+
+        // Join every gap shorter than the n-th shortest, then as many equal to it as needed.
+        size_t n = extents.size() - SPARSE_EXTENTS_MAX - 1;
+        vector<uint64_t> sorted = gaps;
+        nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+        uint64_t limit = sorted[n];
+
+        size_t ties = n + 1;
+        for (size_t i = 0; i < gaps.size(); i++)
+        {
+            if (gaps[i] < limit)  ties--;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 1; i < extents.size(); i++)
+        {
+            uint64_t gap = gaps[i - 1];
+            if (gap < limit || (gap == limit && ties > 0 && ties--))
+            {
+                extents[kept].length = extents[i].offset + extents[i].length - extents[kept].offset;
+            }
+            else
+            {
+                extents[++kept] = extents[i];
+            }
+        }
+
+        extents.resize(kept + 1);
     }
 }
+#endif
 
-void Szip::put(int type, const string& name, unsigned char* buffer, size_t& pos)
+int Szip::put(int type, const string& name, const string& path, ArchiveWriter& writer, Inodes& inodes)
 {
     assert(type == PUT_DIR_T || type == PUT_FILE_T);
 
-    buffer[pos++] = (unsigned char)type;
+    SzipEntry entry;
+    entry.type = type;
 #ifdef _WIN32
-    string t = ansi2utf8((type == PUT_FILE_T) ? baseName(name) : name);
+    entry.name = ansi2utf8(name);
+#else
+    entry.name = name;
+
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+    {
+        return Z_ERRNO;
+    }
+
+    entry.mode = (uint32_t)st.st_mode;
+#ifdef __APPLE__
+    entry.mtime = st.st_mtimespec.tv_sec;
+    entry.mtimeNsec = (uint32_t)st.st_mtimespec.tv_nsec;
 #else
-    string t = (type == PUT_FILE_T) ? baseName(name) : name;
+    entry.mtime = st.st_mtim.tv_sec;
+    entry.mtimeNsec = (uint32_t)st.st_mtim.tv_nsec;
+#endif
+
+    if (S_ISLNK(st.st_mode))
+    {
+        entry.type = PUT_LINK_T;
+        entry.target = readLink(path);
+
+        return writer.begin(entry);
+    }
+
+    if (type == PUT_FILE_T && !S_ISREG(st.st_mode))
+    {
+        // Fifos, sockets and devices have no contents to archive.
+        return Z_OK;
+    }
+
+    // Further names of an already stored file become links to the first one.
+    if (type == PUT_FILE_T && st.st_nlink > 1)
+    {
+        pair<uint64_t, uint64_t> inode((uint64_t)st.st_dev, (uint64_t)st.st_ino);
+        Inodes::const_iterator it = inodes.find(inode);
+        if (it != inodes.end())
+        {
+            entry.type = PUT_HARDLINK_T;
+            entry.target = it->second;
+
+            return writer.begin(entry);
+        }
+
+        inodes[inode] = entry.name;
+    }
+
+#ifdef SEEK_DATA
+    // Fewer allocated blocks than the length needs is the cheap sign of holes.
+    if (type == PUT_FILE_T && (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size)
+    {
+        findExtents(path, (uint64_t)st.st_size, entry.extents);
+        if (entry.extents.size() != 1 || entry.extents[0].length != (uint64_t)st.st_size)
+        {
+            entry.sparseLength = (uint64_t)st.st_size;
+        }
+        else
+        {
+            entry.extents.clear();
+        }
+    }
+#endif
 #endif
-    szip::Bytes::write<unsigned short>((unsigned short)t.length(), buffer, pos);
-    pos += sizeof(unsigned short);
-    memcpy(buffer + pos, (unsigned char*)(t.c_str()), t.length());
-    pos += t.length();
 
-    if (type == PUT_FILE_T)
+    if (type == PUT_DIR_T)
+    {
+        return writer.begin(entry);
+    }
+
+    ifstream is;
+    is.open(path, ios::binary);
+    if (!is)
+    {
+        return Z_ERRNO;
+    }
+
+    vector<SzipExtent> extents = entry.extents;
+    if (entry.sparseLength == 0)
     {
-        ifstream is;
-        is.open(name, ios::binary);
         is.seekg(0, ios::end);
-        int len = (int)is.tellg();
-        szip::Bytes::write<unsigned int>((unsigned int)len, buffer, pos);
-        pos += sizeof(unsigned int);
-        is.seekg(0, ios::beg);
-        is.read((char*)buffer + pos, len);
-        pos += len;
-        is.close();
+        extents.assign(1, SzipExtent{ 0, (uint64_t)is.tellg() });
     }
+
+    entry.size = 0;
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        entry.size += extents[i].length;
+    }
+
+    int result = writer.begin(entry);
+
+    for (size_t i = 0; i < extents.size() && result == Z_OK; i++)
+    {
+        is.clear();
+        is.seekg(extents[i].offset);
+        uint64_t remaining = extents[i].length;
+
+        // Read straight into the writer's block instead of through an intermediate buffer.
+        while (remaining > 0 && result == Z_OK)
+        {
+            size_t len = (size_t)min<uint64_t>(remaining, 1 << 30);
+            unsigned char* p = writer.reserve(len);
+            is.read((char*)p, len);
+
+            // A file that shrank while being read is padded to the size already recorded.
+            size_t n = (size_t)is.gcount();
+            if (n < len)
+            {
+                memset(p + n, 0, len - n);
+            }
+
+            result = writer.commit(len);
+            remaining -= len;
+        }
+    }
+
+    is.close();
+
+    return result;
 }
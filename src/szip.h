@@ -1,26 +1,171 @@
 #pragma once
 
+#include <map>
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <iosfwd>
+#include <future>
+#include <functional>
 
 using namespace std;
 
 #define PUT_DIR_T   1
 #define PUT_FILE_T  2
+#define PUT_LINK_T  3
+#define PUT_HARDLINK_T  4
+
+struct SzipExtent
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct SzipEntry
+{
+    int      type;      // PUT_DIR_T, PUT_FILE_T, PUT_LINK_T or PUT_HARDLINK_T
+    string   name;      // path relative to the archive root, '/' separated
+    uint64_t size;      // bytes of file data
+    uint64_t offset;    // position of the data in the archive's uncompressed record stream
+    uint32_t crc;       // CRC-32 of the data, 0 for legacy archives which don't record it
+    uint32_t mode;      // st_mode including the file type bits, 0 when not recorded
+    int64_t  mtime;     // modification time in seconds since the epoch, valid when mode != 0
+    uint32_t mtimeNsec;
+    string   target;    // what a PUT_LINK_T entry points to; for PUT_HARDLINK_T, the name of an earlier entry
+
+    // A sparse file stores only its data regions, size bytes in total, and is sparseLength
+    // bytes long once the holes between the extents are put back. 0 for other files.
+    uint64_t           sparseLength;
+    vector<SzipExtent> extents;
+
+    SzipEntry() : type(0), size(0), offset(0), crc(0), mode(0), mtime(0), mtimeNsec(0), sparseLength(0) {}
+};
+
+#define SZIP_ORDER_NATURAL  0   // directory order, each directory's files before its subdirectories
+#define SZIP_ORDER_GROUPED  1   // files grouped by extension, then size class, into shared blocks
+#define SZIP_ORDER_CONTENT  2   // as grouped, also split by a fingerprint of each file's first bytes
+
+#define SZIP_CODEC_ZLIB     0   // stock zlib
+#define SZIP_CODEC_FAST     1   // libdeflate if built in, else zlib; output is readable by plain zlib either way
+
+struct ZipOptions
+{
+    int    level;       // zlib level, -1 for zlib's default; SZIP_CODEC_FAST also accepts 10 to 12
+    size_t blockSize;   // uncompressed bytes per independently compressed block, 0 for the default
+    int    order;       // SZIP_ORDER_*; entries keep their paths whatever the order
+    int    codec;       // SZIP_CODEC_*
+    size_t threads;     // blocks compressed at once on the shared thread pool; 0 or 1 compresses inline
+
+    // Splits the archive into volumes of this many bytes, outputFilename.001, .002, ..., each
+    // written by its own pool thread; 0 writes a single file. unzip, list, stat and test take
+    // the name without the suffix and read the volumes in parallel.
+    uint64_t volumeSize;
+
+    ZipOptions() : level(-1), blockSize(0), order(SZIP_ORDER_NATURAL), codec(SZIP_CODEC_ZLIB), threads(1), volumeSize(0) {}
+};
+
+struct UnzipOptions
+{
+    // Leaves a file alone when the one already at its path has the same size and either the
+    // same mtime or the same CRC-32, so redeploying an unchanged tree writes nothing; only the
+    // recorded mode and mtime are reapplied. Needs an indexed archive; ignored on Windows.
+    bool   skipUnchanged;
+
+    // Blocks of an indexed archive decoded ahead of extraction on the shared thread pool.
+    size_t threads;
+
+    UnzipOptions() : skipUnchanged(false), threads(1) {}
+};
+
+class ArchiveWriter;
+class FrameSource;
+
+// Runs a task somewhere other than the calling thread, e.g. on an event loop's worker queue.
+typedef function<void(const function<void()>&)> Executor;
 
 class Szip
 {
 
 public:
 
-    static int compressBytes  (unsigned char* input, size_t len, vector<unsigned char>& output);
+    static int compressBytes  (unsigned char* input, size_t len, vector<unsigned char>& output, int codec = SZIP_CODEC_ZLIB);
     static int uncompressBytes(unsigned char* input, size_t len, vector<unsigned char>& output);
-    static int zip            (const string& sourceDirOrFileName, const string& outputFilename);
-    static int unzip          (const string& szipFilename, const string& outputPath);
+    static int zip            (const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options = ZipOptions());
+    static int unzip          (const string& szipFilename, const string& outputPath, const UnzipOptions& options = UnzipOptions());
+
+    // Stream forms, e.g. for stdin and stdout. Writing never seeks, so os can be a pipe.
+    // Reading goes front to back; only skipUnchanged and listing an indexed archive use
+    // the index at the end, and only when is turns out to be seekable.
+    static int zip            (const string& sourceDirOrFileName, ostream& os, const ZipOptions& options = ZipOptions());
+    static int unzip          (istream& is, const string& outputPath, const UnzipOptions& options = UnzipOptions());
+
+    // Adds sourceDirOrFileName's entries to an existing indexed archive, named as zip would
+    // name them. Only the new data is compressed and written; the index is rewritten in place.
+    // On failure the archive is left as it was. Legacy and split archives return Z_STREAM_ERROR.
+    static int append         (const string& szipFilename, const string& sourceDirOrFileName, const ZipOptions& options = ZipOptions());
+
+    // Entry metadata without extracting: indexed archives only read their index, legacy
+    // archives are inflated with the file data discarded. stat returns Z_STREAM_END if
+    // name is not in the archive.
+    static int list           (const string& szipFilename, vector<SzipEntry>& entries);
+    static int list           (istream& is, vector<SzipEntry>& entries);
+    static int stat           (const string& szipFilename, const string& name, SzipEntry& entry);
+
+    // Decodes every block and checks each file's data against the CRC-32 in the index,
+    // without writing anything. Legacy archives record no CRCs and are only checked for
+    // a well-formed stream. Returns Z_OK or the first error found.
+    static int test           (const string& szipFilename, size_t threads = 1);
+    static int test           (istream& is, size_t threads = 1);
+
+    // Asynchronous variants: run on the given executor, or on the default one (see setExecutor) when empty.
+    // The callback forms are invoked exactly once on the executor's thread; Z_ERRNO reports an exception.
+    static future<int> zipAsync  (const string& sourceDirOrFileName, const string& outputFilename, const Executor& executor = Executor());
+    static future<int> unzipAsync(const string& szipFilename, const string& outputPath, const Executor& executor = Executor());
+    static void        zipAsync  (const string& sourceDirOrFileName, const string& outputFilename, const function<void(int)>& callback, const Executor& executor = Executor());
+    static void        unzipAsync(const string& szipFilename, const string& outputPath, const function<void(int)>& callback, const Executor& executor = Executor());
+
+    // The same with options, e.g. threads, codec or volumes for zip, skipUnchanged for unzip.
+    static future<int> zipAsync  (const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options, const Executor& executor = Executor());
+    static future<int> unzipAsync(const string& szipFilename, const string& outputPath, const UnzipOptions& options, const Executor& executor = Executor());
+    static void        zipAsync  (const string& sourceDirOrFileName, const string& outputFilename, const ZipOptions& options, const function<void(int)>& callback, const Executor& executor = Executor());
+    static void        unzipAsync(const string& szipFilename, const string& outputPath, const UnzipOptions& options, const function<void(int)>& callback, const Executor& executor = Executor());
+
+    // Replaces the default executor; an empty executor restores the internal thread pool.
+    static void setExecutor(const Executor& executor);
+
+    // Peak scratch memory a zip/unzip of these inputs will hold; inputSize receives the bytes to be read.
+    // The options' block size and threads scale the estimate.
+    static size_t estimateZipMemory  (const string& sourceDirOrFileName, size_t& inputSize);
+    static size_t estimateUnzipMemory(const string& szipFilename, size_t& inputSize);
+    static size_t estimateZipMemory  (const string& sourceDirOrFileName, const ZipOptions& options, size_t& inputSize);
+    static size_t estimateUnzipMemory(const string& szipFilename, const UnzipOptions& options, size_t& inputSize);
 
 private:
 
+    static future<int> submit  (const function<int()>& job, const Executor& executor);
+    static void        submit  (const function<int()>& job, const function<void(int)>& callback, const Executor& executor);
+    static void        dispatch(const function<void()>& task, const Executor& executor);
+
+    // source, when given, reads the same archive as is, from the decoding threads.
+    static int extract(istream& is, FrameSource* source, const string& outputPath, const UnzipOptions& options);
+    static int verify (istream& is, FrameSource* source, size_t threads);
+
+    struct Source
+    {
+        int    type;
+        string name;
+        string path;
+        string group;
+    };
+
+    // (device, inode) of each multiply-linked file already stored, to the name it was stored under.
+    typedef map<pair<uint64_t, uint64_t>, string> Inodes;
+
+    static void collect(const string& sourceDirOrFileName, int order, vector<Source>& sources);
+    static int  zipSources(const vector<Source>& sources, ostream& os, const ZipOptions& options);
+    static int  putSources(const vector<Source>& sources, ArchiveWriter& writer);
     static void getFolderSize(const string& dir, const string& rootDir, size_t& size);
-    static void readFile(const string& dir, const string& rootDir, unsigned char* buffer, size_t& pos);
-    static void put(int type, const string& name, unsigned char* buffer, size_t& pos);
+    static void readFile(const string& dir, const string& rootDir, vector<Source>& sources);
+    static void group(vector<Source>& sources, int order);
+    static int  put(int type, const string& name, const string& path, ArchiveWriter& writer, Inodes& inodes);
 };
@@ -1,11 +0,0 @@
-//#include "szip.h"
-//#include <string>
-//
-//int main()
-//{
-//    Szip::zip("C:\\aaaa\\123", "C:\\aaaa\\123.szip");
-//    Szip::unzip("C:\\aaaa\\123.szip", "C:\\aaaa\\124");
-//
-////    Szip::zip("/Users/shove/Desktop/123", "/Users/shove/Desktop/123.szip");
-////    Szip::unzip("/Users/shove/Desktop/123.szip", "/Users/shove/Desktop/124");
-//}
@@ -0,0 +1,91 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(size_t threads) : stopping(false)
+{
+    if (threads == 0)
+    {
+        threads = thread::hardware_concurrency();
+    }
+
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.push_back(thread(&ThreadPool::run, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+
+    available.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+void ThreadPool::post(const function<void()>& task)
+{
+    {
+        unique_lock<mutex> guard(lock);
+        tasks.push_back(task);
+    }
+
+    available.notify_one();
+}
+
+size_t ThreadPool::size() const
+{
+    return workers.size();
+}
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+// private:
+
+void ThreadPool::run()
+{
+    while (true)
+    {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> guard(lock);
+            while (!stopping && tasks.empty())
+            {
+                available.wait(guard);
+            }
+
+            // Drain whatever was queued before shutdown so no future is left unsatisfied.
+            if (tasks.empty())
+            {
+                return;
+            }
+
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+class ThreadPool
+{
+
+public:
+
+    // threads == 0 means one worker per hardware thread.
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    void   post(const function<void()>& task);
+    size_t size() const;
+
+    // Process-wide pool used when no executor is configured.
+    static ThreadPool& shared();
+
+private:
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void run();
+
+    vector<thread>           workers;
+    deque<function<void()>>  tasks;
+    mutex                    lock;
+    condition_variable       available;
+    bool                     stopping;
+};
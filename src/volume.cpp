@@ -0,0 +1,425 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <zlib.h>
+
+#include "filesystem.h"
+#include "threadpool.h"
+
+#include "volume.h"
+
+#define WRITE_CHUNK   (1024 * 1024)
+#define QUEUED_MAX    (16 * WRITE_CHUNK)    // handed over but not yet written, before the producer helps out
+#define READ_CHUNK    (256 * 1024)
+
+string volumeName(const string& name, size_t number)
+{
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".%03u", (unsigned)number);
+
+    return name + suffix;
+}
+
+void removeVolumes(const string& name)
+{
+    for (size_t i = 1; fileExists(volumeName(name, i)); i++)
+    {
+        remove(volumeName(name, i).c_str());
+    }
+}
+
+struct VolumeWriter::Volume
+{
+    ofstream             os;
+    deque<vector<char>>  chunks;
+    bool                 busy;      // a thread is writing this volume's chunks
+    bool                 posted;    // a pool task is on its way to do so
+    bool                 complete;  // no more chunks will come; close once they're written
+
+    Volume() : busy(false), posted(false), complete(false) {}
+};
+
+// Everything pool tasks touch, so that a task running late never sees a destroyed writer.
+struct VolumeWriter::Shared
+{
+    mutex                       lock;
+    condition_variable          changed;
+    vector<shared_ptr<Volume>>  volumes;
+    size_t                      queued;
+    bool                        failed;
+
+    Shared() : queued(0), failed(false) {}
+
+    // Writes out the volume's chunks unless another thread already is. Called with the lock
+    // held; it is dropped around each write.
+    void drain(Volume& volume, unique_lock<mutex>& guard)
+    {
+        if (volume.busy)
+        {
+            return;
+        }
+
+        volume.busy = true;
+        while (!volume.chunks.empty())
+        {
+            vector<char> chunk;
+            chunk.swap(volume.chunks.front());
+            volume.chunks.pop_front();
+
+            guard.unlock();
+            volume.os.write(chunk.data(), chunk.size());
+            bool ok = volume.os.good();
+            guard.lock();
+
+            queued -= chunk.size();
+            failed = failed || !ok;
+            changed.notify_all();
+        }
+
+        if (volume.complete && volume.os.is_open())
+        {
+            guard.unlock();
+            volume.os.close();
+            bool ok = !volume.os.fail();
+            guard.lock();
+
+            failed = failed || !ok;
+        }
+
+        volume.busy = false;
+        changed.notify_all();
+    }
+};
+
+VolumeWriter::VolumeWriter(const string& name, uint64_t volumeSize) :
+    shared(make_shared<Shared>()), name(name), volumeSize(volumeSize), filled(0), chunk(WRITE_CHUNK), closed(false)
+{
+    assert(volumeSize > 0);
+
+    shared_ptr<Volume> first = make_shared<Volume>();
+    first->os.open(volumeName(name, 1), ios::out | ios::binary | ios::trunc);
+    shared->failed = !first->os;
+    shared->volumes.push_back(first);
+
+    setp(chunk.data(), chunk.data() + (size_t)min<uint64_t>(WRITE_CHUNK, volumeSize));
+}
+
+VolumeWriter::~VolumeWriter()
+{
+    close();
+}
+
+int VolumeWriter::close()
+{
+    if (!closed)
+    {
+        submit();
+
+        unique_lock<mutex> guard(shared->lock);
+        shared->volumes.back()->complete = true;
+
+        // Whatever no pool thread has got to yet is written here.
+        for (size_t i = 0; i < shared->volumes.size(); i++)
+        {
+            Volume& volume = *shared->volumes[i];
+            while (volume.busy || !volume.chunks.empty() || volume.os.is_open())
+            {
+                if (volume.busy)
+                {
+                    shared->changed.wait(guard);
+                }
+                else
+                {
+                    shared->drain(volume, guard);
+                }
+            }
+        }
+
+        closed = true;
+    }
+
+    lock_guard<mutex> guard(shared->lock);
+    return shared->failed ? Z_ERRNO : Z_OK;
+}
+
+// protected:
+
+VolumeWriter::int_type VolumeWriter::overflow(int_type c)
+{
+    if (closed || submit() != 0)
+    {
+        return traits_type::eof();
+    }
+
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+int VolumeWriter::sync()
+{
+    return (closed || submit() != 0) ? -1 : 0;
+}
+
+// private:
+
+// Hands what is in the put area to the current volume, starting the next volume first when
+// the current one is full, and makes a new put area that doesn't run past the volume's end.
+int VolumeWriter::submit()
+{
+    size_t n = pptr() - pbase();
+    unique_lock<mutex> guard(shared->lock);
+
+    if (n > 0)
+    {
+        if (filled == volumeSize)
+        {
+            shared_ptr<Volume> next = make_shared<Volume>();
+            next->os.open(volumeName(name, shared->volumes.size() + 1), ios::out | ios::binary | ios::trunc);
+            shared->failed = shared->failed || !next->os;
+
+            shared->volumes.back()->complete = true;
+            post(shared->volumes.back());
+            shared->volumes.push_back(next);
+            filled = 0;
+        }
+
+        shared_ptr<Volume> current = shared->volumes.back();
+        current->chunks.push_back(vector<char>(pbase(), pptr()));
+        shared->queued += n;
+        filled += n;
+        post(current);
+
+        // Writes falling behind: lend a hand rather than buffer without bound.
+        while (shared->queued > QUEUED_MAX && !shared->failed)
+        {
+            Volume* idle = NULL;
+            for (size_t i = 0; i < shared->volumes.size() && idle == NULL; i++)
+            {
+                Volume& volume = *shared->volumes[i];
+                if (!volume.busy && !volume.chunks.empty())  idle = &volume;
+            }
+
+            if (idle != NULL)
+            {
+                shared->drain(*idle, guard);
+            }
+            else
+            {
+                shared->changed.wait(guard);
+            }
+        }
+    }
+
+    uint64_t room = (filled == volumeSize) ? volumeSize : volumeSize - filled;
+    setp(chunk.data(), chunk.data() + (size_t)min<uint64_t>(WRITE_CHUNK, room));
+
+    return shared->failed ? -1 : 0;
+}
+
+// Called with the lock held.
+void VolumeWriter::post(const shared_ptr<Volume>& volume)
+{
+    if (volume->posted)
+    {
+        return;
+    }
+
+    volume->posted = true;
+    shared_ptr<Shared> state = shared;
+    ThreadPool::shared().post([state, volume]()
+    {
+        unique_lock<mutex> guard(state->lock);
+        volume->posted = false;
+        state->drain(*volume, guard);
+    });
+}
+
+VolumeSet::VolumeSet() : total(0)
+{
+
+}
+
+bool VolumeSet::open(const string& name)
+{
+    volumes.clear();
+    total = 0;
+
+    for (size_t i = 1; ; i++)
+    {
+        string path = volumeName(name, i);
+        if (!isFile(path))
+        {
+            break;
+        }
+
+        unique_ptr<Volume> volume(new Volume());
+        volume->path = path;
+        volume->start = total;
+        volume->length = fileLength(path);
+        total += volume->length;
+        volumes.push_back(move(volume));
+    }
+
+    return !volumes.empty();
+}
+
+uint64_t VolumeSet::size() const
+{
+    return total;
+}
+
+int VolumeSet::read(uint64_t offset, unsigned char* data, size_t len)
+{
+    if (offset > total || len > total - offset)
+    {
+        return Z_DATA_ERROR;
+    }
+
+    // The last volume starting at or before offset holds it.
+    size_t i = 0, lo = 0, hi = volumes.size();
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (volumes[mid]->start <= offset)
+        {
+            i = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    for (; len > 0; i++)
+    {
+        Volume& volume = *volumes[i];
+        size_t n = (size_t)min<uint64_t>(len, volume.start + volume.length - offset);
+
+        lock_guard<mutex> guard(volume.lock);
+        if (!volume.is.is_open())
+        {
+            volume.is.open(volume.path, ios::binary);
+        }
+
+        volume.is.clear();
+        volume.is.seekg(offset - volume.start);
+        volume.is.read((char*)data, n);
+        if ((size_t)volume.is.gcount() != n)
+        {
+            // Shorter than when the set was opened.
+            return Z_DATA_ERROR;
+        }
+
+        data += n;
+        offset += n;
+        len -= n;
+    }
+
+    return Z_OK;
+}
+
+VolumeReader::VolumeReader(VolumeSet& volumes) : volumes(volumes), buffer(READ_CHUNK), position(0)
+{
+    setg(buffer.data(), buffer.data(), buffer.data());
+}
+
+// protected:
+
+VolumeReader::int_type VolumeReader::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    position += egptr() - eback();
+    setg(buffer.data(), buffer.data(), buffer.data());
+
+    size_t n = (size_t)min<uint64_t>(buffer.size(), volumes.size() - position);
+    if (n == 0 || volumes.read(position, (unsigned char*)buffer.data(), n) != Z_OK)
+    {
+        return traits_type::eof();
+    }
+
+    setg(buffer.data(), buffer.data(), buffer.data() + n);
+
+    return traits_type::to_int_type(*gptr());
+}
+
+// Large reads go straight into the caller's memory.
+streamsize VolumeReader::xsgetn(char* s, streamsize n)
+{
+    streamsize done = 0;
+    while (done < n)
+    {
+        streamsize available = egptr() - gptr();
+        if (available > 0)
+        {
+            streamsize k = min(available, n - done);
+            memcpy(s + done, gptr(), (size_t)k);
+            gbump((int)k);
+            done += k;
+            continue;
+        }
+
+        if (n - done < (streamsize)buffer.size())
+        {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+            {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t at = position + (egptr() - eback());
+        size_t k = (size_t)min<uint64_t>(n - done, volumes.size() - at);
+        if (k == 0 || volumes.read(at, (unsigned char*)s + done, k) != Z_OK)
+        {
+            break;
+        }
+
+        position = at + k;
+        setg(buffer.data(), buffer.data(), buffer.data());
+        done += k;
+    }
+
+    return done;
+}
+
+VolumeReader::pos_type VolumeReader::seekoff(off_type off, ios_base::seekdir way, ios_base::openmode which)
+{
+    int64_t current = (int64_t)(position + (gptr() - eback()));
+    int64_t base = (way == ios_base::beg) ? 0 : ((way == ios_base::cur) ? current : (int64_t)volumes.size());
+    int64_t target = base + off;
+
+    if (!(which & ios_base::in) || target < 0 || (uint64_t)target > volumes.size())
+    {
+        return pos_type(off_type(-1));
+    }
+
+    // Within what is buffered, just move the read pointer.
+    if ((uint64_t)target >= position && (uint64_t)target <= position + (egptr() - eback()))
+    {
+        setg(eback(), eback() + (target - position), egptr());
+    }
+    else
+    {
+        position = (uint64_t)target;
+        setg(buffer.data(), buffer.data(), buffer.data());
+    }
+
+    return pos_type(target);
+}
+
+VolumeReader::pos_type VolumeReader::seekpos(pos_type pos, ios_base::openmode which)
+{
+    return seekoff(off_type(pos), ios_base::beg, which);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <streambuf>
+#include <cstdint>
+
+#include "archive.h"
+
+using namespace std;
+
+// A split archive is the byte stream of an ordinary archive cut into volumes of a fixed size,
+// named name.001, name.002, ... Frames may straddle volumes; the volumes concatenated are the
+// single-file archive.
+
+// number counts from 1.
+string volumeName(const string& name, size_t number);
+void   removeVolumes(const string& name);
+
+// Writes a stream out as volumes. Every volume has a file of its own whose data is written
+// by pool threads while the following volumes fill, so a slow target doesn't hold up the
+// next one.
+class VolumeWriter : public streambuf
+{
+
+public:
+
+    VolumeWriter(const string& name, uint64_t volumeSize);
+    ~VolumeWriter();
+
+    // Waits for every volume to be written and closed. Returns Z_OK or Z_ERRNO.
+    int close();
+
+protected:
+
+    int_type overflow(int_type c);
+    int      sync();
+
+private:
+
+    struct Volume;
+    struct Shared;
+
+    VolumeWriter(const VolumeWriter&);
+    VolumeWriter& operator=(const VolumeWriter&);
+
+    int  submit();
+    void post(const shared_ptr<Volume>& volume);
+
+    shared_ptr<Shared>  shared;
+    string              name;
+    uint64_t            volumeSize;
+    uint64_t            filled;     // bytes of the current volume handed over so far
+    vector<char>        chunk;      // the put area
+    bool                closed;
+};
+
+// The volumes of a split archive, read as one.
+class VolumeSet : public FrameSource
+{
+
+public:
+
+    VolumeSet();
+
+    // Finds name.001 and the volumes following it; false when there is no first volume.
+    bool     open(const string& name);
+    uint64_t size() const;
+
+    // Reads of different volumes run in parallel.
+    int      read(uint64_t offset, unsigned char* data, size_t len);
+
+private:
+
+    struct Volume
+    {
+        string   path;
+        uint64_t start;
+        uint64_t length;
+        ifstream is;        // opened on first use
+        mutex    lock;
+    };
+
+    VolumeSet(const VolumeSet&);
+    VolumeSet& operator=(const VolumeSet&);
+
+    vector<unique_ptr<Volume>> volumes;
+    uint64_t                   total;
+};
+
+// A seekable input stream buffer over a VolumeSet, for code that reads through an istream.
+class VolumeReader : public streambuf
+{
+
+public:
+
+    explicit VolumeReader(VolumeSet& volumes);
+
+protected:
+
+    int_type   underflow();
+    streamsize xsgetn(char* s, streamsize n);
+    pos_type   seekoff(off_type off, ios_base::seekdir way, ios_base::openmode which = ios_base::in | ios_base::out);
+    pos_type   seekpos(pos_type pos, ios_base::openmode which = ios_base::in | ios_base::out);
+
+private:
+
+    VolumeReader(const VolumeReader&);
+    VolumeReader& operator=(const VolumeReader&);
+
+    VolumeSet&    volumes;
+    vector<char>  buffer;
+    uint64_t      position;     // archive offset of the start of buffer
+};